@@ -0,0 +1,14 @@
+#ifndef _SA1_H
+#define _SA1_H
+
+// the RDRAM SA1 loads things into: SA2 has to fit below SA1_RAM_END, and an app is told it has all of it (osMemSize)
+#define SA1_RAM_SIZE (0x00800000)
+
+// the last page is kept back for the boot trace (trace.h), so loading SA2 can't overwrite it; sa1.lcf checks SA1
+// itself stays clear of it too
+#define TRACE_SIZE (0x1000)
+#define TRACE_PHYS_ADDR (SA1_RAM_SIZE - TRACE_SIZE)
+
+#define SA1_RAM_END (TRACE_PHYS_ADDR)
+
+#endif
@@ -0,0 +1,45 @@
+#include <PR/ultratypes.h>
+
+#include "checksum.h"
+
+/*
+ * Additive byte checksum (CMD_FILE_CHECKSUM), summed a word at a time
+ *
+ * SUM_BYTES adds the bytes of a word pairwise into 16-bit lanes, which can take SUM_WORDS_PER_FOLD words before they
+ * could overflow, so the lanes only need folding into the total once per 512 bytes
+ */
+
+#define SUM_BYTES(w) (((w) & 0x00FF00FF) + (((w) >> 8) & 0x00FF00FF))
+#define SUM_WORDS_PER_FOLD (128)
+
+u32 update_checksum(u8 *data, u32 size, u32 checksum) {
+    u32 *words;
+
+    while ((size > 0) && ((u32)data & 3)) {
+        checksum += *data++;
+        size--;
+    }
+
+    words = (u32 *)data;
+    while (size >= SUM_WORDS_PER_FOLD * sizeof(u32)) {
+        u32 lanes = 0;
+
+        for (u32 i = 0; i < SUM_WORDS_PER_FOLD; i += 4) {
+            lanes += SUM_BYTES(words[i]);
+            lanes += SUM_BYTES(words[i + 1]);
+            lanes += SUM_BYTES(words[i + 2]);
+            lanes += SUM_BYTES(words[i + 3]);
+        }
+        checksum += (lanes & 0xFFFF) + (lanes >> 16);
+
+        words += SUM_WORDS_PER_FOLD;
+        size -= SUM_WORDS_PER_FOLD * sizeof(u32);
+    }
+
+    data = (u8 *)words;
+    while (size--) {
+        checksum += *data++;
+    }
+
+    return checksum;
+}
@@ -0,0 +1,9 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <PR/ultratypes.h>
+
+// sum of all the bytes, same as adding them one at a time; pass 0 to start, or a previous result to continue
+u32 update_checksum(u8 *data, u32 size, u32 checksum);
+
+#endif
@@ -0,0 +1,49 @@
+#include <PR/ultratypes.h>
+
+#include "crc32.h"
+
+/*
+ * Table-driven CRC-32 (reflected, polynomial 0xEDB88320), a byte per lookup
+ *
+ * The 1KiB table is built the first time it's needed rather than taking up space in the image
+ */
+
+#define CRC32_POLY (0xEDB88320)
+
+static u32 crc_table[256];
+static s32 crc_table_ready = FALSE;
+
+static void make_crc_table(void) {
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+
+        for (u32 j = 0; j < 8; j++) {
+            c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        }
+        crc_table[i] = c;
+    }
+
+    crc_table_ready = TRUE;
+}
+
+u32 crc32(u32 crc, u8 *data, u32 size) {
+    if (!crc_table_ready) {
+        make_crc_table();
+    }
+
+    crc = ~crc;
+
+    while (size >= 4) {
+        crc = crc_table[(crc ^ data[0]) & 0xFF] ^ (crc >> 8);
+        crc = crc_table[(crc ^ data[1]) & 0xFF] ^ (crc >> 8);
+        crc = crc_table[(crc ^ data[2]) & 0xFF] ^ (crc >> 8);
+        crc = crc_table[(crc ^ data[3]) & 0xFF] ^ (crc >> 8);
+        data += 4;
+        size -= 4;
+    }
+    while (size--) {
+        crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
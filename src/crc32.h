@@ -0,0 +1,9 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <PR/ultratypes.h>
+
+// the usual (zlib/PNG) CRC-32; pass 0 to start, or a previous result to continue
+u32 crc32(u32 crc, u8 *data, u32 size);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _DECOMPRESS_H
+#define _DECOMPRESS_H
+
+#include <PR/ultratypes.h>
+
+typedef struct InStream {
+    u8 *next;
+    u8 *end;
+    // called once next reaches end; should point next/end at more input and return 0, or return non-zero if there is none
+    s32 (*refill)(struct InStream *);
+} InStream;
+
+#define DECOMPRESS_ERR_INPUT (-1)
+#define DECOMPRESS_ERR_DATA (-2)
+#define DECOMPRESS_ERR_OUTPUT (-3)
+
+// LZ4 legacy frame magic, stored little-endian
+#define LZ4_LEGACY_MAGIC (0x184C2102)
+
+typedef struct {
+    u32 val;
+} __attribute__((packed)) UnalignedWord;
+
+/*
+ * Copies `len` bytes a word at a time, from and to any alignment
+ *
+ * Also fine for a match overlapping its own output, as long as it starts at least a word back: each word only reads
+ * bytes that are already written
+ */
+static inline void copy_words(u8 *dst, u8 *src, u32 len) {
+    while (len >= sizeof(u32)) {
+        ((UnalignedWord *)dst)->val = ((UnalignedWord *)src)->val;
+        dst += sizeof(u32);
+        src += sizeof(u32);
+        len -= sizeof(u32);
+    }
+    while (len--) {
+        *dst++ = *src++;
+    }
+}
+
+/*
+ * Decompress a stream pulled from `in` into `out`
+ *
+ * Returns -ve if decompress fails, else returns size of output
+ * On DECOMPRESS_ERR_OUTPUT, `out` holds the first `out_size` bytes of the stream
+ */
+s32 inflate_gzip(InStream *in, u8 *out, u32 out_size);
+s32 lz4_decompress(InStream *in, u8 *out, u32 out_size);
+
+/*
+ * Compress `size` bytes (at most 64KiB - 1) from `src` into a raw LZ4 block (no frame) at `dst`
+ *
+ * Returns the compressed size, or 0 if it doesn't fit in `dst_size` bytes
+ */
+s32 lz4_compress_block(u8 *src, u32 size, u8 *dst, u32 dst_size);
+
+/*
+ * Decompress a raw LZ4 block of `size` bytes from `src` into `dst`
+ *
+ * Returns -ve if decompress fails (DECOMPRESS_ERR_OUTPUT if it's bigger than `dst_size`), else returns size of output
+ */
+s32 lz4_decompress_block(u8 *src, u32 size, u8 *dst, u32 dst_size);
+
+#endif
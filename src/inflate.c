@@ -0,0 +1,584 @@
+#include <PR/ultratypes.h>
+#include <macros.h>
+
+#include "decompress.h"
+
+/*
+ * DEFLATE decoder tuned for the VR4300
+ *
+ * - input is pulled through a 32-bit bit buffer, topped up a byte at a time only when it drops below 25 bits
+ * - Huffman codes up to FAST_BITS long are decoded with a single table lookup; longer (rare) codes fall back to a canonical walk
+ * - each table is a 1KiB lookup plus the canonical counts/symbols, so both live tables fit comfortably in the 16KiB D-cache
+ * - matches are copied a word at a time where the distance allows
+ */
+
+#define MAX_BITS (15)
+#define MAX_LCODES (286)
+#define MAX_DCODES (30)
+#define FIX_LCODES (288)
+
+#define FAST_BITS (9)
+#define FAST_MASK ((1 << FAST_BITS) - 1)
+
+typedef struct {
+    // (symbol << 4) | code length, or 0 if the code is longer than FAST_BITS
+    u16 fast[1 << FAST_BITS];
+    u16 count[MAX_BITS + 1];
+    u16 symbol[FIX_LCODES];
+} Huffman;
+
+typedef struct {
+    InStream *in;
+    u32 bitbuf;
+    u32 bitcnt;
+    // number of zero bytes made up after the input ran out
+    u32 overrun;
+
+    u8 *out_start;
+    u8 *out;
+    u8 *out_end;
+} Inflate;
+
+static const u16 length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const u8 dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// order in which the code length code lengths are stored
+static const u8 clen_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static Huffman fixed_lencode;
+static Huffman fixed_distcode;
+static s32 fixed_built = FALSE;
+
+static u32 refill_byte(Inflate *s) {
+    InStream *in = s->in;
+
+    // once the input has run out, keep feeding zeroes and let overrun() catch any attempt to use them
+    if ((s->overrun == 0) && (in->refill != NULL) && (in->refill(in) == 0)) {
+        return *in->next++;
+    }
+
+    s->overrun++;
+    return 0;
+}
+
+// tops the bit buffer up to at least 25 bits
+static inline void fill_bits(Inflate *s) {
+    InStream *in = s->in;
+
+    while (s->bitcnt <= 24) {
+        u32 byte;
+
+        if (in->next != in->end) {
+            byte = *in->next++;
+        } else {
+            byte = refill_byte(s);
+        }
+
+        s->bitbuf |= byte << s->bitcnt;
+        s->bitcnt += 8;
+    }
+}
+
+static inline void drop_bits(Inflate *s, u32 n) {
+    s->bitbuf >>= n;
+    s->bitcnt -= n;
+}
+
+static inline u32 bits(Inflate *s, u32 need) {
+    u32 val;
+
+    if (s->bitcnt < need) {
+        fill_bits(s);
+    }
+
+    val = s->bitbuf & ((1 << need) - 1);
+    drop_bits(s, need);
+
+    return val;
+}
+
+// true if any of the made up bytes have been consumed
+static inline s32 overrun(Inflate *s) {
+    return s->bitcnt < (s->overrun * 8);
+}
+
+// returns 0 for a complete code, -ve if over-subscribed and +ve if incomplete
+static s32 construct(Huffman *h, const u16 *length, u32 n) {
+    s32 left;
+    u16 offs[MAX_BITS + 1];
+    u16 next_code[MAX_BITS + 1];
+
+    for (u32 i = 0; i < ARRLEN(h->fast); i++) {
+        h->fast[i] = 0;
+    }
+
+    for (u32 len = 0; len <= MAX_BITS; len++) {
+        h->count[len] = 0;
+    }
+    for (u32 symbol = 0; symbol < n; symbol++) {
+        h->count[length[symbol]]++;
+    }
+    if (h->count[0] == n) {
+        return 0;
+    }
+
+    left = 1;
+    for (u32 len = 1; len <= MAX_BITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) {
+            return left;
+        }
+    }
+
+    offs[1] = 0;
+    next_code[1] = 0;
+    for (u32 len = 1; len < MAX_BITS; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+        next_code[len + 1] = (next_code[len] + h->count[len]) << 1;
+    }
+
+    for (u32 symbol = 0; symbol < n; symbol++) {
+        u32 len = length[symbol];
+        u32 code, rev;
+
+        if (len == 0) {
+            continue;
+        }
+
+        h->symbol[offs[len]++] = symbol;
+
+        code = next_code[len]++;
+        if (len > FAST_BITS) {
+            continue;
+        }
+
+        // codes are packed starting from their most significant bit, but the bit buffer is read from the bottom
+        rev = 0;
+        for (u32 i = 0; i < len; i++) {
+            rev = (rev << 1) | ((code >> i) & 1);
+        }
+
+        for (u32 i = rev; i < ARRLEN(h->fast); i += 1 << len) {
+            h->fast[i] = (symbol << 4) | len;
+        }
+    }
+
+    return left;
+}
+
+static s32 decode_slow(Inflate *s, const Huffman *h) {
+    u32 buf = s->bitbuf;
+    s32 code = 0;
+    s32 first = 0;
+    s32 index = 0;
+
+    for (u32 len = 1; len <= MAX_BITS; len++) {
+        s32 count;
+
+        code |= buf & 1;
+        buf >>= 1;
+        count = h->count[len];
+        if (code - count < first) {
+            drop_bits(s, len);
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return DECOMPRESS_ERR_DATA;
+}
+
+static inline s32 decode(Inflate *s, const Huffman *h) {
+    u32 entry;
+
+    if (s->bitcnt < MAX_BITS) {
+        fill_bits(s);
+    }
+
+    entry = h->fast[s->bitbuf & FAST_MASK];
+    if (entry == 0) {
+        return decode_slow(s, h);
+    }
+
+    drop_bits(s, entry & 0xF);
+    return entry >> 4;
+}
+
+static inline void copy_match(u8 *out, u32 dist, u32 len) {
+    u8 *src = out - dist;
+
+    if (dist == 1) {
+        u8 val = *src;
+
+        while (len--) {
+            *out++ = val;
+        }
+    } else if (dist >= sizeof(u32)) {
+        copy_words(out, src, len);
+    } else {
+        while (len--) {
+            *out++ = *src++;
+        }
+    }
+}
+
+static s32 stored(Inflate *s) {
+    InStream *in = s->in;
+    u32 len, nlen;
+    s32 ret = 0;
+
+    // skip to the next byte boundary
+    drop_bits(s, s->bitcnt & 7);
+
+    len = bits(s, 16);
+    nlen = bits(s, 16);
+    if (overrun(s)) {
+        return DECOMPRESS_ERR_INPUT;
+    }
+    if (len != (~nlen & 0xFFFF)) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    if (len > (u32)(s->out_end - s->out)) {
+        len = s->out_end - s->out;
+        ret = DECOMPRESS_ERR_OUTPUT;
+    }
+
+    // use up whatever whole bytes are already sitting in the bit buffer first
+    while ((len > 0) && (s->bitcnt > (s->overrun * 8))) {
+        *s->out++ = bits(s, 8);
+        len--;
+    }
+
+    while (len > 0) {
+        u32 chunk;
+
+        if (in->next == in->end) {
+            u32 byte = refill_byte(s);
+
+            if (s->overrun) {
+                return DECOMPRESS_ERR_INPUT;
+            }
+            *s->out++ = byte;
+            len--;
+            continue;
+        }
+
+        chunk = in->end - in->next;
+        if (chunk > len) {
+            chunk = len;
+        }
+        len -= chunk;
+
+        copy_words(s->out, in->next, chunk);
+        s->out += chunk;
+        in->next += chunk;
+    }
+
+    return ret;
+}
+
+static s32 codes(Inflate *s, const Huffman *lencode, const Huffman *distcode) {
+    u8 *out = s->out;
+    u8 *out_end = s->out_end;
+    s32 ret = 0;
+
+    while (TRUE) {
+        s32 symbol;
+        u32 len, dist;
+
+        symbol = decode(s, lencode);
+        if (symbol < 256) {
+            if (symbol < 0) {
+                ret = symbol;
+                break;
+            }
+            if (out == out_end) {
+                ret = DECOMPRESS_ERR_OUTPUT;
+                break;
+            }
+            *out++ = symbol;
+            continue;
+        }
+
+        if (overrun(s)) {
+            ret = DECOMPRESS_ERR_INPUT;
+            break;
+        }
+
+        if (symbol == 256) {
+            break;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29) {
+            ret = DECOMPRESS_ERR_DATA;
+            break;
+        }
+        len = length_base[symbol] + bits(s, length_extra[symbol]);
+
+        symbol = decode(s, distcode);
+        if ((symbol < 0) || (symbol >= 30)) {
+            ret = DECOMPRESS_ERR_DATA;
+            break;
+        }
+        dist = dist_base[symbol] + bits(s, dist_extra[symbol]);
+        if (overrun(s)) {
+            ret = DECOMPRESS_ERR_INPUT;
+            break;
+        }
+        if (dist > (u32)(out - s->out_start)) {
+            ret = DECOMPRESS_ERR_DATA;
+            break;
+        }
+
+        if (len > (u32)(out_end - out)) {
+            len = out_end - out;
+            ret = DECOMPRESS_ERR_OUTPUT;
+        }
+
+        copy_match(out, dist, len);
+        out += len;
+
+        if (ret) {
+            break;
+        }
+    }
+
+    s->out = out;
+
+    // literals don't check for overrun, so catch it here instead
+    if (((ret == 0) || (ret == DECOMPRESS_ERR_OUTPUT)) && overrun(s)) {
+        ret = DECOMPRESS_ERR_INPUT;
+    }
+
+    return ret;
+}
+
+static s32 fixed(Inflate *s) {
+    if (fixed_built == FALSE) {
+        u16 lengths[FIX_LCODES];
+        u32 symbol;
+
+        for (symbol = 0; symbol < 144; symbol++) {
+            lengths[symbol] = 8;
+        }
+        for (; symbol < 256; symbol++) {
+            lengths[symbol] = 9;
+        }
+        for (; symbol < 280; symbol++) {
+            lengths[symbol] = 7;
+        }
+        for (; symbol < FIX_LCODES; symbol++) {
+            lengths[symbol] = 8;
+        }
+        construct(&fixed_lencode, lengths, FIX_LCODES);
+
+        for (symbol = 0; symbol < MAX_DCODES; symbol++) {
+            lengths[symbol] = 5;
+        }
+        construct(&fixed_distcode, lengths, MAX_DCODES);
+
+        fixed_built = TRUE;
+    }
+
+    return codes(s, &fixed_lencode, &fixed_distcode);
+}
+
+static s32 dynamic(Inflate *s) {
+    u32 nlen, ndist, ncode;
+    u32 index;
+    s32 err;
+    u16 lengths[MAX_LCODES + MAX_DCODES];
+    Huffman lencode, distcode;
+
+    nlen = bits(s, 5) + 257;
+    ndist = bits(s, 5) + 1;
+    ncode = bits(s, 4) + 4;
+    if ((nlen > MAX_LCODES) || (ndist > MAX_DCODES)) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    for (index = 0; index < ncode; index++) {
+        lengths[clen_order[index]] = bits(s, 3);
+    }
+    for (; index < 19; index++) {
+        lengths[clen_order[index]] = 0;
+    }
+    if (overrun(s)) {
+        return DECOMPRESS_ERR_INPUT;
+    }
+
+    // the code length code must be complete
+    if (construct(&lencode, lengths, 19) != 0) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    index = 0;
+    while (index < nlen + ndist) {
+        s32 symbol;
+        u32 len;
+
+        symbol = decode(s, &lencode);
+        if (overrun(s)) {
+            return DECOMPRESS_ERR_INPUT;
+        }
+        if (symbol < 0) {
+            return symbol;
+        }
+
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+
+        len = 0;
+        if (symbol == 16) {
+            if (index == 0) {
+                return DECOMPRESS_ERR_DATA;
+            }
+            len = lengths[index - 1];
+            symbol = 3 + bits(s, 2);
+        } else if (symbol == 17) {
+            symbol = 3 + bits(s, 3);
+        } else {
+            symbol = 11 + bits(s, 7);
+        }
+        if (index + symbol > nlen + ndist) {
+            return DECOMPRESS_ERR_DATA;
+        }
+        while (symbol--) {
+            lengths[index++] = len;
+        }
+    }
+
+    // an end-of-block code is required
+    if (lengths[256] == 0) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    // incomplete codes are only allowed if there's a single length
+    err = construct(&lencode, lengths, nlen);
+    if ((err < 0) || ((err > 0) && (nlen - lencode.count[0] != 1))) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    err = construct(&distcode, lengths + nlen, ndist);
+    if ((err < 0) || ((err > 0) && (ndist - distcode.count[0] != 1))) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    return codes(s, &lencode, &distcode);
+}
+
+#define GZIP_FHCRC (1 << 1)
+#define GZIP_FEXTRA (1 << 2)
+#define GZIP_FNAME (1 << 3)
+#define GZIP_FCOMMENT (1 << 4)
+
+static s32 gzip_header(Inflate *s) {
+    u32 flags;
+
+    if ((bits(s, 8) != 0x1F) || (bits(s, 8) != 0x8B) || (bits(s, 8) != 8)) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    flags = bits(s, 8);
+
+    // mtime, xfl, os
+    for (u32 i = 0; i < 6; i++) {
+        bits(s, 8);
+    }
+
+    if (flags & GZIP_FEXTRA) {
+        u32 len = bits(s, 16);
+
+        while (len-- && !overrun(s)) {
+            bits(s, 8);
+        }
+    }
+
+    if (flags & GZIP_FNAME) {
+        while (bits(s, 8) && !overrun(s))
+            ;
+    }
+
+    if (flags & GZIP_FCOMMENT) {
+        while (bits(s, 8) && !overrun(s))
+            ;
+    }
+
+    if (flags & GZIP_FHCRC) {
+        bits(s, 16);
+    }
+
+    return overrun(s) ? DECOMPRESS_ERR_INPUT : 0;
+}
+
+s32 inflate_gzip(InStream *in, u8 *out, u32 out_size) {
+    Inflate s;
+    s32 ret;
+    s32 last;
+    u32 isize;
+
+    s.in = in;
+    s.bitbuf = 0;
+    s.bitcnt = 0;
+    s.overrun = 0;
+    s.out_start = out;
+    s.out = out;
+    s.out_end = out + out_size;
+
+    ret = gzip_header(&s);
+    if (ret) {
+        return ret;
+    }
+
+    do {
+        u32 type;
+
+        last = bits(&s, 1);
+        type = bits(&s, 2);
+        if (overrun(&s)) {
+            return DECOMPRESS_ERR_INPUT;
+        }
+
+        if (type == 0) {
+            ret = stored(&s);
+        } else if (type == 1) {
+            ret = fixed(&s);
+        } else if (type == 2) {
+            ret = dynamic(&s);
+        } else {
+            ret = DECOMPRESS_ERR_DATA;
+        }
+
+        if (ret) {
+            return ret;
+        }
+    } while (!last);
+
+    // trailer is byte aligned: crc32, then the uncompressed size mod 2^32
+    drop_bits(&s, s.bitcnt & 7);
+
+    bits(&s, 16);
+    bits(&s, 16);
+
+    isize = bits(&s, 16);
+    isize |= bits(&s, 16) << 16;
+    if (overrun(&s)) {
+        return DECOMPRESS_ERR_INPUT;
+    }
+
+    if (isize != (u32)(s.out - s.out_start)) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    return s.out - s.out_start;
+}
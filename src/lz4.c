@@ -0,0 +1,376 @@
+#include <PR/ultratypes.h>
+#include <macros.h>
+
+#include "decompress.h"
+
+/*
+ * LZ4 decoder for the legacy frame format (as written by `lz4 -l` or tools/sa2pack.py)
+ *
+ * A frame is the magic followed by blocks, each a little-endian compressed size and then raw LZ4 sequences
+ * Decoding stops at a zero size (block padding) or the end of the input
+ *
+ * There's also a fast greedy block compressor and a single block decoder (no frame), used by mon for blocks going
+ * over USB
+ */
+
+#define MIN_MATCH (4)
+
+typedef struct {
+    InStream *in;
+    // compressed bytes left in the current block
+    u32 remaining;
+
+    u8 *out_start;
+    u8 *out;
+    u8 *out_end;
+} Lz4;
+
+// returns the next input byte, or -1 if there isn't one
+static s32 next_byte(InStream *in) {
+    if (in->next == in->end) {
+        if ((in->refill == NULL) || in->refill(in)) {
+            return -1;
+        }
+    }
+
+    return *in->next++;
+}
+
+static s32 block_byte(Lz4 *s) {
+    s32 byte;
+
+    if (s->remaining == 0) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    byte = next_byte(s->in);
+    if (byte < 0) {
+        return DECOMPRESS_ERR_INPUT;
+    }
+
+    s->remaining--;
+    return byte;
+}
+
+// reads the 255-terminated extension of a length field
+static s32 extend_length(Lz4 *s, u32 *len) {
+    s32 byte;
+
+    do {
+        byte = block_byte(s);
+        if (byte < 0) {
+            return byte;
+        }
+        *len += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+static s32 copy_literals(Lz4 *s, u32 len) {
+    InStream *in = s->in;
+    s32 ret = 0;
+
+    if (len > s->remaining) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    while (len > 0) {
+        u32 chunk;
+
+        if (in->next == in->end) {
+            if ((in->refill == NULL) || in->refill(in)) {
+                return DECOMPRESS_ERR_INPUT;
+            }
+        }
+
+        chunk = in->end - in->next;
+        if (chunk > len) {
+            chunk = len;
+        }
+        len -= chunk;
+        s->remaining -= chunk;
+
+        if (chunk > (u32)(s->out_end - s->out)) {
+            chunk = s->out_end - s->out;
+            len = 0;
+            ret = DECOMPRESS_ERR_OUTPUT;
+        }
+
+        copy_words(s->out, in->next, chunk);
+        s->out += chunk;
+        in->next += chunk;
+    }
+
+    return ret;
+}
+
+static s32 copy_match(Lz4 *s, u32 offset, u32 len) {
+    u8 *out = s->out;
+    u8 *src = out - offset;
+    s32 ret = 0;
+
+    if ((offset == 0) || (offset > (u32)(out - s->out_start))) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    if (len > (u32)(s->out_end - out)) {
+        len = s->out_end - out;
+        ret = DECOMPRESS_ERR_OUTPUT;
+    }
+
+    s->out += len;
+
+    if (offset >= sizeof(u32)) {
+        copy_words(out, src, len);
+    } else {
+        while (len--) {
+            *out++ = *src++;
+        }
+    }
+
+    return ret;
+}
+
+static s32 decode_block(Lz4 *s) {
+    s32 ret;
+
+    while (s->remaining > 0) {
+        s32 token, lo, hi;
+        u32 len;
+
+        token = block_byte(s);
+        if (token < 0) {
+            return token;
+        }
+
+        len = token >> 4;
+        if (len == 15) {
+            ret = extend_length(s, &len);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        ret = copy_literals(s, len);
+        if (ret) {
+            return ret;
+        }
+
+        // the last sequence of a block is literals only
+        if (s->remaining == 0) {
+            break;
+        }
+
+        lo = block_byte(s);
+        hi = block_byte(s);
+        if ((lo < 0) || (hi < 0)) {
+            return DECOMPRESS_ERR_DATA;
+        }
+
+        len = token & 15;
+        if (len == 15) {
+            ret = extend_length(s, &len);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        ret = copy_match(s, lo | (hi << 8), len + MIN_MATCH);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// reads a little-endian word, returns 1 if the input ended cleanly before it and -ve if it ended partway through
+static s32 next_word(InStream *in, u32 *word) {
+    *word = 0;
+
+    for (u32 i = 0; i < 4; i++) {
+        s32 byte = next_byte(in);
+
+        if (byte < 0) {
+            return (i == 0) ? 1 : DECOMPRESS_ERR_INPUT;
+        }
+        *word |= (u32)byte << (i * 8);
+    }
+
+    return 0;
+}
+
+s32 lz4_decompress(InStream *in, u8 *out, u32 out_size) {
+    Lz4 s;
+    s32 ret;
+    u32 word;
+
+    s.in = in;
+    s.out_start = out;
+    s.out = out;
+    s.out_end = out + out_size;
+
+    ret = next_word(in, &word);
+    if (ret) {
+        return DECOMPRESS_ERR_INPUT;
+    }
+    if (word != LZ4_LEGACY_MAGIC) {
+        return DECOMPRESS_ERR_DATA;
+    }
+
+    while (TRUE) {
+        ret = next_word(in, &word);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((ret > 0) || (word == 0)) {
+            break;
+        }
+
+        // concatenated frames just repeat the magic
+        if (word == LZ4_LEGACY_MAGIC) {
+            continue;
+        }
+
+        s.remaining = word;
+        ret = decode_block(&s);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return s.out - s.out_start;
+}
+
+s32 lz4_decompress_block(u8 *src, u32 size, u8 *dst, u32 dst_size) {
+    InStream in;
+    Lz4 s;
+    s32 ret;
+
+    in.next = src;
+    in.end = src + size;
+    in.refill = NULL;
+
+    s.in = &in;
+    s.remaining = size;
+    s.out_start = dst;
+    s.out = dst;
+    s.out_end = dst + dst_size;
+
+    ret = decode_block(&s);
+    if (ret) {
+        return ret;
+    }
+
+    return s.out - s.out_start;
+}
+
+// the last match has to start at least MF_LIMIT bytes from the end, and the last LAST_LITERALS bytes are always literals
+#define MF_LIMIT (12)
+#define LAST_LITERALS (5)
+
+#define HASH_BITS (12)
+
+// positions of recently seen 4-byte sequences; stale entries are harmless since every candidate gets checked
+static u16 hash_table[1 << HASH_BITS];
+
+static u32 load_word(u8 *p) {
+    return ((UnalignedWord *)p)->val;
+}
+
+static u32 hash_word(u32 word) {
+    return (word * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u8 *put_length(u8 *op, u32 len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+
+    return op;
+}
+
+// returns NULL if the sequence doesn't fit
+static u8 *put_sequence(u8 *op, u8 *op_end, u8 *literals, u32 lit_len, u32 offset, u32 match_len) {
+    u8 *token = op++;
+
+    // worst case: token, literal length, literals, offset, match length
+    if ((op_end - op) < (s32)(lit_len + (lit_len / 255) + (match_len / 255) + 6)) {
+        return NULL;
+    }
+
+    *token = MIN(lit_len, 15) << 4;
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    while (lit_len--) {
+        *op++ = *literals++;
+    }
+
+    if (match_len != 0) {
+        match_len -= MIN_MATCH;
+        *token |= MIN(match_len, 15);
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (match_len >= 15) {
+            op = put_length(op, match_len - 15);
+        }
+    }
+
+    return op;
+}
+
+s32 lz4_compress_block(u8 *src, u32 size, u8 *dst, u32 dst_size) {
+    u8 *ip = src;
+    u8 *anchor = src;
+    u8 *match_limit = src + size - LAST_LITERALS;
+    u8 *op = dst;
+    u8 *op_end = dst + dst_size;
+
+    // positions have to fit in the hash table, and matches in the 16-bit offset
+    if (size > 0xFFFF) {
+        return 0;
+    }
+
+    if (size > MF_LIMIT) {
+        u8 *limit = src + size - MF_LIMIT;
+
+        while (ip < limit) {
+            u32 word = load_word(ip);
+            u32 hash = hash_word(word);
+            u8 *ref = src + hash_table[hash];
+            u32 len;
+
+            hash_table[hash] = ip - src;
+
+            if ((ref >= ip) || (load_word(ref) != word)) {
+                // step faster through data that isn't matching
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            len = MIN_MATCH;
+            while (((ip + len) < match_limit) && (ref[len] == ip[len])) {
+                len++;
+            }
+
+            op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, len);
+            if (op == NULL) {
+                return 0;
+            }
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, op_end, anchor, src + size - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - dst;
+}
@@ -10,6 +10,7 @@
 #include "mon.h"
 #include "sa2.h"
 #include "stack.h"
+#include "trace.h"
 #include "video.h"
 
 void __osBbVideoPllInit(s32);
@@ -108,6 +109,8 @@ u32 read_controllers(void) {
 #define PRESSED(key) ((change & (key)) && (status & (key)))
 
 void boot(u32 entry_type) {
+    trace_init(entry_type);
+
     // clear button interrupt
     IO_WRITE(MI_3C_REG, 0x01000000);
 
@@ -122,6 +125,7 @@ void boot(u32 entry_type) {
 
         // don't care about return value from this
         setup_vi(framebuffer);
+        trace_event(TRACE_SETUP_VI, 0, 0);
     } else {
         // warmboot
 
@@ -129,6 +133,7 @@ void boot(u32 entry_type) {
     }
 
     osInitialize();
+    trace_event(TRACE_OS_INIT, 0, 0);
 
     osCreateThread(&idlethread, 1, idleproc, (void *)entry_type, idlestack + sizeof(idlestack), 20);
     osStartThread(&idlethread);
@@ -191,11 +196,26 @@ void dump_v2(void) {
 }
 #endif
 
+void print_menu(void) {
+    fbClear();
+
+    fbPrintStr(FB_WHITE, 3, 2, "Loader init");
+    fbPrintStr(FB_WHITE, 3, 3, "Press A to launch SA2");
+    fbPrintStr(FB_WHITE, 3, 4, "Press B to launch high app");
+    fbPrintStr(FB_WHITE, 3, 5, "Press Start to launch low app");
+#ifdef PATCHED_SK
+    fbPrintStr(FB_WHITE, 3, 6, "Press C left to dump V2");
+#endif
+    fbPrintStr(FB_WHITE, 3, 7, "Press C right for boot trace");
+    osWritebackDCacheAll();
+}
+
 void mainproc(void *argv) {
     s32 ret;
     SA2Entry sa2_addr;
     u32 num_controllers;
     u32 launch_which = 0;
+    s32 showing_trace = FALSE;
 #ifdef MON
     s32 is_usb_host = FALSE;
     s32 is_attached = FALSE;
@@ -230,6 +250,10 @@ void mainproc(void *argv) {
     osStartThread(&buttonthread);
 
     num_controllers = controller_init();
+    trace_event(TRACE_CONTROLLER_INIT, num_controllers, 0);
+
+    // get going on SA2 while waiting for the user
+    start_sa2_prefetch();
 
     if (num_controllers == 0) {
         // should never happen!
@@ -237,13 +261,7 @@ void mainproc(void *argv) {
         fbPrintStr(fbRed, 3, 4, "Launching SA2");
         osWritebackDCacheAll();
     } else {
-        fbPrintStr(FB_WHITE, 3, 3, "Press A to launch SA2");
-        fbPrintStr(FB_WHITE, 3, 4, "Press B to launch high app");
-        fbPrintStr(FB_WHITE, 3, 5, "Press Start to launch low app");
-#ifdef PATCHED_SK
-        fbPrintStr(FB_WHITE, 3, 6, "Press C left to dump V2");
-#endif
-        osWritebackDCacheAll();
+        print_menu();
 
         while (TRUE) {
             u32 cont_data;
@@ -269,10 +287,22 @@ void mainproc(void *argv) {
                 break;
             } else if (PRESSED(L_CBUTTONS)) {
 #ifdef PATCHED_SK
+                // the loader has the NAND, so stop it for the dump and start it over afterwards
+                cancel_sa2_prefetch();
                 dump_v2();
+                start_sa2_prefetch();
 #endif
+            } else if (PRESSED(R_CBUTTONS)) {
+                showing_trace = !showing_trace;
+                if (showing_trace) {
+                    print_trace();
+                } else {
+                    print_menu();
+                }
             }
         }
+
+        trace_event(TRACE_MENU_CHOICE, launch_which, 0);
     }
 
 #define USB_DISABLED (0)
@@ -307,8 +337,9 @@ void mainproc(void *argv) {
     if ((is_attached == FALSE) || (is_usb_host == TRUE)) {
 #endif
         if (launch_which == 0) {
-            ret = load_sa2(&sa2_addr);
+            ret = finish_sa2_prefetch(&sa2_addr);
             if (ret) {
+                print_sa2_error();
                 fbPrintStr(FB_WHITE, 3, 12, "Load SA2 failed");
                 osWritebackDCacheAll();
             } else {
@@ -318,6 +349,7 @@ void mainproc(void *argv) {
 
                 osBbSetErrorLed(0);
 
+                trace_event(TRACE_LAUNCH, launch_which, (u32)sa2_addr);
                 launch_sa2(sa2_addr, (u32)argv);
 
                 fbPrintStr(fbRed, 3, 12, "Launch SA2 failed");
@@ -326,13 +358,18 @@ void mainproc(void *argv) {
                 osBbPowerOff();
             }
         } else if (launch_which == 1) {
+            cancel_sa2_prefetch();
             launch_app("00000000.app");
         } else if (launch_which == 2) {
+            cancel_sa2_prefetch();
             launch_app("btstrplo.app");
         }
 #ifdef MON
     }
 
+    // mon needs the card to itself
+    cancel_sa2_prefetch();
+
     // launch mon
     // ignore the return value
     mon();
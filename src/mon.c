@@ -2,10 +2,16 @@
 #include <bbtypes.h>
 #include <libfb.h>
 #include <macros.h>
+#include <sha1.h>
 
 #include "blocks.h"
+#include "checksum.h"
+#include "crc32.h"
+#include "decompress.h"
 #include "mon.h"
+#include "nand.h"
 #include "stack.h"
+#include "trace.h"
 
 s32 skGetId(BbId *);
 s32 skSignHash(BbShaHash *, BbEccSig *);
@@ -32,6 +38,39 @@ extern s32 __osBbIsBb;
 
 OSBbFs fs;
 
+// how osBbFInit lays out the FAT it loads into fs; only the first block's worth is needed for the directory
+#define BB_FAT_ENTRIES (4096)
+#define BB_INODES (409)
+
+typedef struct {
+    u8 name[8];
+    u8 ext[3];
+    u8 type;
+    u16 block;
+    u16 pad;
+    u32 size;
+} BbInode;
+
+typedef struct {
+    u16 entry[BB_FAT_ENTRIES];
+    BbInode inode[BB_INODES];
+    u8 magic[4];
+    u32 seqno;
+    u16 link;
+    u16 cksum;
+} BbFat;
+
+// one file in a CMD_FS_LIST reply
+typedef struct {
+    u8 name[8];
+    u8 ext[3];
+    u8 type;
+    u32 size;
+    u16 blocks;
+    // first block of the file
+    u16 block;
+} FsListEntry;
+
 OSThread ledthread;
 void ledproc(void *);
 u8 ledstack[STACK_SIZE] __attribute__((aligned(STACK_ALIGN)));
@@ -42,13 +81,156 @@ OSMesg led_mesg_buf[1];
 char filename_buf[0x100];
 
 // holds 1 block
-u8 block_buf[BYTES_PER_BLOCK];
+u8 block_buf[BYTES_PER_BLOCK] __attribute__((aligned(8)));
 
 // holds 1 spare
-u8 spare_buf[16];
+u8 spare_buf[16] __attribute__((aligned(8)));
 
 u8 bad_buf[BYTES_PER_BLOCK];
 
+// bulk transfers go through this pool, so the card, the CPU and USB can each be working on a different block
+#define NUM_STREAM_BUFS (3)
+u8 stream_buf[NUM_STREAM_BUFS][BYTES_PER_BLOCK] __attribute__((aligned(8)));
+u8 stream_spare_buf[NUM_STREAM_BUFS][16] __attribute__((aligned(8)));
+// compressed blocks waiting to be sent; single block reads use the first one
+u8 packed_buf[NUM_STREAM_BUFS][BYTES_PER_BLOCK] __attribute__((aligned(8)));
+
+typedef enum {
+    CARD_READ,
+    CARD_WRITE,
+    CARD_WRITE_IF_CHANGED,
+    CARD_FILE_READ,
+    CARD_FILE_WRITE,
+    // handled by the USB thread rather than the card thread
+    USB_SEND_BLOCK,
+} CardOp;
+
+// how a block read off the card will go over USB
+typedef struct {
+    // fill byte if the block is uniform, else -1 (or FILL_REJECTED for a write the host sent an unusable payload for)
+    s32 fill;
+    // size of the LZ4 block in packed, or 0 to send it raw
+    u32 packed_size;
+    u8 *packed;
+    // time spent working this out
+    u32 cycles;
+} BlockPayload;
+
+typedef struct {
+    CardOp op;
+    u16 block;
+    u8 *data;
+    u8 *spare;
+    s32 ret;
+    // result of sending the block to the host
+    s32 usb_ret;
+    // for writes, only the fill byte is used
+    BlockPayload payload;
+
+    // for file reads and writes instead of block
+    s32 fd;
+    u32 offset;
+    u32 size;
+} CardRequest;
+
+CardRequest card_req[NUM_STREAM_BUFS];
+
+// card accesses for bulk transfers happen on this thread; requests are handled (and completed) in order
+OSThread cardthread;
+void cardproc(void *);
+u8 cardstack[STACK_SIZE] __attribute__((aligned(STACK_ALIGN)));
+
+OSMesgQueue card_req_queue;
+OSMesg card_req_buf[NUM_STREAM_BUFS];
+
+// both threads hand finished requests back through this
+OSMesgQueue card_done_queue;
+OSMesg card_done_buf[NUM_STREAM_BUFS];
+
+// block reads go out to the host on this thread, so mon can prepare the next one meanwhile
+OSThread usbthread;
+void usbproc(void *);
+u8 usbstack[STACK_SIZE] __attribute__((aligned(STACK_ALIGN)));
+
+OSMesgQueue usb_req_queue;
+OSMesg usb_req_buf[NUM_STREAM_BUFS];
+
+#define STREAM_WITH_SPARE (1 << 0)
+// for bulk writes, leave alone any block that already holds what's being written (only with STREAM_WITH_SPARE)
+#define STREAM_SKIP_IDENTICAL (1 << 1)
+// for bulk writes, the top half of the flags is how many blocks to send statuses for at a time (0 for all at the end)
+// it's rounded up to a multiple of 4, so each report starts on a word
+#define STREAM_STATUS_INTERVAL(flags) ((flags) >> 16)
+
+// low byte of each bulk-written block's status
+u8 write_status_buf[NAND_MAX_BLOCKS] __attribute__((aligned(8)));
+
+// what's on the card already, for conditional writes
+u8 compare_buf[BYTES_PER_BLOCK] __attribute__((aligned(8)));
+u8 compare_spare_buf[16] __attribute__((aligned(8)));
+
+// status for a conditional write that found the block already up to date; well clear of the card driver's own
+// statuses, even as the low byte in a bulk write report
+#define WRITE_SKIPPED (0x40)
+// status for a write whose payload couldn't be decoded; nothing is written
+#define WRITE_BAD_PAYLOAD (-0x40)
+
+// per-block digests are collected here and sent whenever it fills up
+u8 digest_buf[BYTES_PER_BLOCK] __attribute__((aligned(8)));
+
+#define HASH_SHA1 (1 << 0)
+
+// single block reads that look sequential get the next block read in the background, into one of these
+#define READAHEAD_BLOCKS (2)
+
+typedef struct {
+    CardRequest req;
+    // block held (or being read), or -1
+    s32 block;
+    s32 pending;
+} ReadAheadEntry;
+
+ReadAheadEntry readahead[READAHEAD_BLOCKS];
+u8 readahead_buf[READAHEAD_BLOCKS][BYTES_PER_BLOCK] __attribute__((aligned(8)));
+u8 readahead_spare_buf[READAHEAD_BLOCKS][16] __attribute__((aligned(8)));
+
+// -1 until there's been a read, so the first one (even of block 0) doesn't count as sequential
+s32 last_read_block = -1;
+
+// optional block transfer features, negotiated with CMD_SET_XFER_MODE; with none, blocks go over as raw 16KiB as always
+#define XFER_UNIFORM (1 << 0)
+#define XFER_LZ4 (1 << 1)
+#define XFER_SUPPORTED (XFER_UNIFORM | XFER_LZ4)
+
+u32 xfer_mode = 0;
+
+// covers the most recent read command, for CMD_GET_XFER_STATS
+typedef struct {
+    u32 blocks;
+    u32 raw_blocks;
+    u32 uniform_blocks;
+    u32 lz4_blocks;
+    // what the blocks would have taken raw, and what actually went over
+    u32 raw_bytes;
+    u32 wire_bytes;
+    // spent checking for uniform blocks and compressing
+    u32 prepare_cycles;
+    u32 pad;
+} XferStats;
+
+XferStats xfer_stats;
+
+// with any mode set, each block payload starts with one of these
+#define PAYLOAD_RAW (0)
+#define PAYLOAD_UNIFORM (1)
+#define PAYLOAD_LZ4 (2)
+
+#define PAYLOAD_HEADER(type, arg) (((type) << 24) | (arg))
+#define PAYLOAD_TYPE(header) ((header) >> 24)
+#define PAYLOAD_ARG(header) ((header) & 0xFFFFFF)
+
+#define FILL_REJECTED (-2)
+
 void flash_led(u32 delay) {
     osBbSetErrorLed(1);
     __osBbDelay(delay);
@@ -83,55 +265,909 @@ void stop_led_thread(void) {
     osBbSetErrorLed(0);
 }
 
-u32 update_checksum(u8 *data, u32 size, u32 checksum) {
-    for (u32 i = 0; i < size; i++) {
-        checksum += data[i];
+// returns the byte every byte of the block is equal to, or -1 if they aren't all the same
+s32 uniform_fill(u8 *data, u32 size) {
+    u32 *words = (u32 *)data;
+    u32 pattern = data[0] * 0x01010101;
+
+    for (u32 i = 0; i < size / sizeof(u32); i += 4) {
+        if ((words[i] ^ pattern) | (words[i + 1] ^ pattern) | (words[i + 2] ^ pattern) | (words[i + 3] ^ pattern)) {
+            return -1;
+        }
     }
-    return checksum;
+
+    return data[0];
 }
 
-s32 checksum_file(const char *filename, u32 size, u32 expected_checksum) {
+void prepare_payload(u8 *data, BlockPayload *payload) {
+    u32 start = osGetCount();
+
+    payload->fill = -1;
+    payload->packed_size = 0;
+
+    if (xfer_mode & XFER_UNIFORM) {
+        payload->fill = uniform_fill(data, BYTES_PER_BLOCK);
+    }
+
+    // only worth it if it comes out smaller than the raw block, header included
+    if ((payload->fill < 0) && (xfer_mode & XFER_LZ4)) {
+        payload->packed_size = lz4_compress_block(data, BYTES_PER_BLOCK, payload->packed, BYTES_PER_BLOCK - sizeof(u32));
+    }
+
+    payload->cycles = osGetCount() - start;
+}
+
+s32 send_block_payload(u8 *data, BlockPayload *payload) {
+    s32 ret;
+    u32 header;
+
+    xfer_stats.blocks++;
+    xfer_stats.raw_bytes += BYTES_PER_BLOCK;
+    xfer_stats.prepare_cycles += payload->cycles;
+
+    if (xfer_mode == 0) {
+        xfer_stats.raw_blocks++;
+        xfer_stats.wire_bytes += BYTES_PER_BLOCK;
+        return osBbWriteHost(data, BYTES_PER_BLOCK);
+    }
+
+    if (payload->fill >= 0) {
+        xfer_stats.uniform_blocks++;
+        xfer_stats.wire_bytes += sizeof(header);
+        header = PAYLOAD_HEADER(PAYLOAD_UNIFORM, payload->fill);
+        return osBbWriteHost(&header, sizeof(header));
+    }
+
+    if (payload->packed_size != 0) {
+        xfer_stats.lz4_blocks++;
+        xfer_stats.wire_bytes += sizeof(header) + ALIGN(payload->packed_size, 4);
+        header = PAYLOAD_HEADER(PAYLOAD_LZ4, payload->packed_size);
+        ret = osBbWriteHost(&header, sizeof(header));
+        if (ret < 0) {
+            return ret;
+        }
+
+        // padded out to a whole word
+        return osBbWriteHost(payload->packed, ALIGN(payload->packed_size, 4));
+    }
+
+    xfer_stats.raw_blocks++;
+    xfer_stats.wire_bytes += sizeof(header) + BYTES_PER_BLOCK;
+    header = PAYLOAD_HEADER(PAYLOAD_RAW, BYTES_PER_BLOCK);
+    ret = osBbWriteHost(&header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    return osBbWriteHost(data, BYTES_PER_BLOCK);
+}
+
+// for the single block read commands, which only ever have the one block on the go
+s32 send_read_block(u8 *data) {
+    BlockPayload payload;
+
+    bzero(&xfer_stats, sizeof(xfer_stats));
+
+    payload.packed = packed_buf[0];
+    prepare_payload(data, &payload);
+
+    return send_block_payload(data, &payload);
+}
+
+// reads and drops size bytes from the host, to stay in step after a payload that can't be used
+s32 discard_host_bytes(u32 size) {
+    s32 ret = 0;
+
+    while (size > 0) {
+        u32 chunk = MIN(size, sizeof(packed_buf[0]));
+
+        ret = osBbReadHost(packed_buf[0], chunk);
+        if (ret < 0) {
+            return ret;
+        }
+        size -= chunk;
+    }
+
+    return ret;
+}
+
+// fills in the whole block either way, and sets fill if the host said it's uniform
+// a payload that can't be decoded is still read in full, and sets fill to FILL_REJECTED
+// nothing is ever sent while a block is being received, so the first packed buffer is free for LZ4 payloads
+s32 recv_block_payload(u8 *data, s32 *fill) {
+    s32 ret;
+    u32 header;
+
+    *fill = -1;
+
+    if (xfer_mode == 0) {
+        return osBbReadHost(data, BYTES_PER_BLOCK);
+    }
+
+    ret = osBbReadHost(&header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    switch (PAYLOAD_TYPE(header)) {
+        case PAYLOAD_RAW:
+            return osBbReadHost(data, BYTES_PER_BLOCK);
+
+        case PAYLOAD_UNIFORM:
+            {
+                u32 *words = (u32 *)data;
+
+                *fill = PAYLOAD_ARG(header) & 0xFF;
+                for (u32 i = 0; i < BYTES_PER_BLOCK / sizeof(u32); i++) {
+                    words[i] = *fill * 0x01010101;
+                }
+                return 0;
+            }
+
+        case PAYLOAD_LZ4:
+            {
+                u32 size = PAYLOAD_ARG(header);
+
+                if ((size == 0) || (size > sizeof(packed_buf[0]))) {
+                    break;
+                }
+
+                // padded out to a whole word
+                ret = osBbReadHost(packed_buf[0], ALIGN(size, 4));
+                if (ret < 0) {
+                    return ret;
+                }
+
+                if (lz4_decompress_block(packed_buf[0], size, data, BYTES_PER_BLOCK) != BYTES_PER_BLOCK) {
+                    *fill = FILL_REJECTED;
+                }
+                return 0;
+            }
+    }
+
+    // unknown type or a bad size; the argument is taken as the size of what follows
+    *fill = FILL_REJECTED;
+    return discard_host_bytes(ALIGN(PAYLOAD_ARG(header), 4));
+}
+
+s32 write_card_block(u16 block, u8 *data, u8 *spare, s32 fill) {
+    s32 ret = 0;
+
+    if (fill == FILL_REJECTED) {
+        return WRITE_BAD_PAYLOAD;
+    }
+
+    osBbCardEraseBlock(0, block);
+
+    // an erased block already reads back as all 0xFF, so there's nothing to program
+    if ((fill != 0xFF) || ((spare != NULL) && (uniform_fill(spare, 16) != 0xFF))) {
+        ret = osBbCardWriteBlock(0, block, data, spare);
+    }
+
+    // the write may have changed (or failed and marked) the block's status
+    forget_block(block);
+
+    return ret;
+}
+
+s32 words_equal(u8 *a, u8 *b, u32 size) {
+    u32 *wa = (u32 *)a;
+    u32 *wb = (u32 *)b;
+
+    for (u32 i = 0; i < size / sizeof(u32); i += 4) {
+        if ((wa[i] ^ wb[i]) | (wa[i + 1] ^ wb[i + 1]) | (wa[i + 2] ^ wb[i + 2]) | (wa[i + 3] ^ wb[i + 3])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// reads the block back first and only erases and programs it if the data or spare is different
+// without a spare there's nothing to tell whether the spare on the card matches what a write would leave, so it's
+// always written
+s32 write_card_block_if_changed(u16 block, u8 *data, u8 *spare, s32 fill) {
+    if (fill == FILL_REJECTED) {
+        return WRITE_BAD_PAYLOAD;
+    }
+
+    if ((spare != NULL) && (osBbCardReadBlock(0, block, compare_buf, compare_spare_buf) == 0) &&
+        words_equal(data, compare_buf, BYTES_PER_BLOCK) &&
+        words_equal(spare, compare_spare_buf, sizeof(compare_spare_buf))) {
+        return WRITE_SKIPPED;
+    }
+
+    return write_card_block(block, data, spare, fill);
+}
+
+void cardproc(void *argv) {
+    CardRequest *req;
+
+    while (TRUE) {
+        osRecvMesg(&card_req_queue, (OSMesg *)&req, OS_MESG_BLOCK);
+
+        switch (req->op) {
+            case CARD_READ:
+                req->ret = osBbCardReadBlock(0, req->block, req->data, req->spare);
+                break;
+
+            case CARD_WRITE:
+                req->ret = write_card_block(req->block, req->data, req->spare, req->payload.fill);
+                break;
+
+            case CARD_WRITE_IF_CHANGED:
+                req->ret = write_card_block_if_changed(req->block, req->data, req->spare, req->payload.fill);
+                break;
+
+            case CARD_FILE_READ:
+                osInvalDCache(req->data, req->size);
+                req->ret = osBbFRead(req->fd, req->offset, req->data, req->size);
+                break;
+
+            case CARD_FILE_WRITE:
+                osWritebackDCache(req->data, req->size);
+                req->ret = osBbFWrite(req->fd, req->offset, req->data, req->size);
+                break;
+
+            default:
+                break;
+        }
+
+        osSendMesg(&card_done_queue, (OSMesg)req, OS_MESG_BLOCK);
+    }
+}
+
+// sends a bulk read record: (block, status), the data and optionally the spare
+s32 send_stream_block(CardRequest *req) {
+    s32 ret;
+    u32 header[2];
+
+    header[0] = req->block;
+    header[1] = req->ret;
+    ret = osBbWriteHost(header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = send_block_payload(req->data, &req->payload);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (req->spare != NULL) {
+        ret = osBbWriteHost(req->spare, sizeof(stream_spare_buf[0]));
+    }
+
+    return ret;
+}
+
+void usbproc(void *argv) {
+    CardRequest *req;
+
+    while (TRUE) {
+        osRecvMesg(&usb_req_queue, (OSMesg *)&req, OS_MESG_BLOCK);
+
+        req->usb_ret = send_stream_block(req);
+
+        osSendMesg(&card_done_queue, (OSMesg)req, OS_MESG_BLOCK);
+    }
+}
+
+void start_card_thread(void) {
+    static s32 initialised = FALSE;
+    if (initialised == FALSE) {
+        osCreateMesgQueue(&card_req_queue, card_req_buf, ARRLEN(card_req_buf));
+        osCreateMesgQueue(&card_done_queue, card_done_buf, ARRLEN(card_done_buf));
+        osCreateMesgQueue(&usb_req_queue, usb_req_buf, ARRLEN(usb_req_buf));
+        // above mon itself, so the card and USB get going again as soon as a request comes in
+        osCreateThread(&cardthread, 10, cardproc, NULL, cardstack + sizeof(cardstack), 19);
+        osStartThread(&cardthread);
+        osCreateThread(&usbthread, 11, usbproc, NULL, usbstack + sizeof(usbstack), 19);
+        osStartThread(&usbthread);
+        initialised = TRUE;
+    }
+}
+
+void submit_card_request(CardRequest *req, CardOp op, u16 block) {
+    req->op = op;
+    req->block = block;
+    req->ret = 0;
+    osSendMesg(&card_req_queue, (OSMesg)req, OS_MESG_BLOCK);
+}
+
+void submit_file_read(CardRequest *req, s32 fd, u32 offset, u32 size) {
+    req->fd = fd;
+    req->offset = offset;
+    req->size = size;
+    submit_card_request(req, CARD_FILE_READ, 0);
+}
+
+void submit_file_write(CardRequest *req, s32 fd, u32 offset, u32 size) {
+    req->fd = fd;
+    req->offset = offset;
+    req->size = size;
+    submit_card_request(req, CARD_FILE_WRITE, 0);
+}
+
+void submit_usb_send(CardRequest *req) {
+    req->op = USB_SEND_BLOCK;
+    req->usb_ret = 0;
+    osSendMesg(&usb_req_queue, (OSMesg)req, OS_MESG_BLOCK);
+}
+
+// the next request either thread has finished with
+CardRequest *wait_card_request(void) {
+    CardRequest *req;
+
+    osRecvMesg(&card_done_queue, (OSMesg *)&req, OS_MESG_BLOCK);
+
+    return req;
+}
+
+// sends each block as (block, status), the data and optionally the spare
+// each buffer goes card -> mon (to prepare the payload) -> USB and back, so with three of them reading, compressing
+// and sending all overlap; requests complete in order on both threads, so blocks still go out in order
+s32 stream_read_blocks(u32 start, u32 count, u32 flags) {
+    s32 ret = 0;
+    u32 next = 0;
+    u32 in_flight = 0;
+
+    bzero(&xfer_stats, sizeof(xfer_stats));
+
+    for (u32 i = 0; i < NUM_STREAM_BUFS; i++) {
+        card_req[i].data = stream_buf[i];
+        card_req[i].spare = (flags & STREAM_WITH_SPARE) ? stream_spare_buf[i] : NULL;
+        card_req[i].payload.packed = packed_buf[i];
+    }
+
+    for (; (next < count) && (next < NUM_STREAM_BUFS); next++, in_flight++) {
+        submit_card_request(&card_req[next], CARD_READ, start + next);
+    }
+
+    // even if the host goes away, everything queued has to finish before the buffers can be reused
+    while (in_flight > 0) {
+        CardRequest *req = wait_card_request();
+
+        if (req->op == CARD_READ) {
+            if (ret < 0) {
+                in_flight--;
+                continue;
+            }
+
+            prepare_payload(req->data, &req->payload);
+            submit_usb_send(req);
+            continue;
+        }
+
+        in_flight--;
+
+        if (req->usb_ret < 0) {
+            ret = req->usb_ret;
+        }
+        if (ret < 0) {
+            continue;
+        }
+
+        if (next < count) {
+            submit_card_request(req, CARD_READ, start + next++);
+            in_flight++;
+        }
+    }
+
+    return ret;
+}
+
+// receives each block (and optionally its spare) while the previous one is being erased and programmed
+s32 stream_write_blocks(u32 start, u32 count, u32 flags) {
+    s32 ret = 0;
+    u32 submitted = 0;
+    u32 done = 0;
+    u32 reported = 0;
+    u32 interval = ALIGN(STREAM_STATUS_INTERVAL(flags), 4);
+
+    if (interval == 0) {
+        interval = count;
+    }
+
+    for (u32 i = 0; i < NUM_STREAM_BUFS; i++) {
+        card_req[i].data = stream_buf[i];
+        card_req[i].spare = (flags & STREAM_WITH_SPARE) ? stream_spare_buf[i] : NULL;
+    }
+
+    while (submitted < count) {
+        CardRequest *req = &card_req[submitted % NUM_STREAM_BUFS];
+
+        // requests complete in order, so this frees up req
+        if ((submitted - done) == NUM_STREAM_BUFS) {
+            write_status_buf[done++] = wait_card_request()->ret;
+        }
+
+        ret = recv_block_payload(req->data, &req->payload.fill);
+        if (ret < 0) {
+            break;
+        }
+
+        if (req->spare != NULL) {
+            ret = osBbReadHost(req->spare, sizeof(stream_spare_buf[0]));
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        submit_card_request(req, (flags & STREAM_SKIP_IDENTICAL) ? CARD_WRITE_IF_CHANGED : CARD_WRITE,
+                            start + submitted++);
+
+        if (((submitted % interval) == 0) || (submitted == count)) {
+            while (done < submitted) {
+                write_status_buf[done++] = wait_card_request()->ret;
+            }
+
+            // the last report is padded out to a word with zeroes
+            bzero(write_status_buf + submitted, ALIGN(submitted, 4) - submitted);
+            ret = osBbWriteHost(write_status_buf + reported, ALIGN(submitted - reported, 4));
+            if (ret < 0) {
+                break;
+            }
+            reported = submitted;
+        }
+    }
+
+    while (done < submitted) {
+        write_status_buf[done++] = wait_card_request()->ret;
+    }
+
+    return ret;
+}
+
+// sends (status, digest of data + spare) for each block; the digest is a CRC-32, or SHA-1 with HASH_SHA1
+// the card reads ahead while each block is hashed
+s32 hash_blocks(u32 start, u32 count, u32 flags) {
+    s32 ret = 0;
+    u32 used = 0;
+    u32 next = 0;
+    u32 done = 0;
+    u32 in_flight = 0;
+    u32 entry_size = sizeof(u32) + ((flags & HASH_SHA1) ? sizeof(BbShaHash) : sizeof(u32));
+
+    for (u32 i = 0; i < NUM_STREAM_BUFS; i++) {
+        card_req[i].data = stream_buf[i];
+        card_req[i].spare = stream_spare_buf[i];
+    }
+
+    for (; (next < count) && (next < NUM_STREAM_BUFS); next++, in_flight++) {
+        bzero(card_req[next].spare, sizeof(stream_spare_buf[0]));
+        submit_card_request(&card_req[next], CARD_READ, start + next);
+    }
+
+    while (in_flight > 0) {
+        CardRequest *req = wait_card_request();
+        u8 *entry = digest_buf + used;
+        in_flight--;
+
+        if (ret < 0) {
+            continue;
+        }
+
+        *(s32 *)entry = req->ret;
+
+        if (flags & HASH_SHA1) {
+            SHA1Context ctx;
+
+            SHA1Reset(&ctx);
+            SHA1Input(&ctx, req->data, BYTES_PER_BLOCK);
+            SHA1Input(&ctx, req->spare, sizeof(stream_spare_buf[0]));
+            SHA1Result(&ctx, entry + sizeof(u32));
+        } else {
+            u32 crc = crc32(0, req->data, BYTES_PER_BLOCK);
+
+            *(u32 *)(entry + sizeof(u32)) = crc32(crc, req->spare, sizeof(stream_spare_buf[0]));
+        }
+
+        if (next < count) {
+            bzero(req->spare, sizeof(stream_spare_buf[0]));
+            submit_card_request(req, CARD_READ, start + next++);
+            in_flight++;
+        }
+
+        used += entry_size;
+        done++;
+        if ((used + entry_size > sizeof(digest_buf)) || (done == count)) {
+            ret = osBbWriteHost(digest_buf, used);
+            used = 0;
+        }
+    }
+
+    return ret;
+}
+
+void readahead_wait(ReadAheadEntry *entry) {
+    while (entry->pending) {
+        CardRequest *req = wait_card_request();
+
+        // only read-ahead requests are ever left in flight between commands
+        for (u32 i = 0; i < READAHEAD_BLOCKS; i++) {
+            if (req == &readahead[i].req) {
+                readahead[i].pending = FALSE;
+            }
+        }
+    }
+}
+
+// the card driver can only be used from one thread at a time, so this must be called before mon touches it directly
+void readahead_settle(void) {
+    for (u32 i = 0; i < READAHEAD_BLOCKS; i++) {
+        readahead_wait(&readahead[i]);
+    }
+}
+
+// must be called before anything else uses the card or the card thread, and whenever the card may have changed
+void readahead_flush(void) {
+    readahead_settle();
+    for (u32 i = 0; i < READAHEAD_BLOCKS; i++) {
+        readahead[i].block = -1;
+    }
+    last_read_block = -1;
+}
+
+ReadAheadEntry *readahead_find(u32 block, s32 with_spare) {
+    for (u32 i = 0; i < READAHEAD_BLOCKS; i++) {
+        if ((readahead[i].block == (s32)block) && ((readahead[i].req.spare != NULL) == with_spare)) {
+            return &readahead[i];
+        }
+    }
+
+    return NULL;
+}
+
+// for the single block read commands; returns where the block's data is, with spare (if not NULL) filled in
+// once reads look sequential, the block after this one is read while this one goes over USB
+u8 *read_block_cached(u16 block, u8 *spare, s32 *status) {
+    ReadAheadEntry *hit = readahead_find(block, spare != NULL);
+    s32 sequential = (hit != NULL) || ((last_read_block >= 0) && (block == last_read_block + 1));
+    u8 *data;
+
+    if (hit != NULL) {
+        readahead_wait(hit);
+        *status = hit->req.ret;
+        data = hit->req.data;
+        if (spare != NULL) {
+            bcopy(hit->req.spare, spare, sizeof(readahead_spare_buf[0]));
+        }
+    } else {
+        // nothing else can be using the card while it's read from here
+        readahead_flush();
+
+        *status = osBbCardReadBlock(0, block, block_buf, spare);
+        data = block_buf;
+    }
+
+    if (sequential && (block + 1 < osBbCardBlocks(0)) &&
+        (readahead_find(block + 1, spare != NULL) == NULL)) {
+        // the entry not being sent from; with two, that's always the other one
+        ReadAheadEntry *entry = &readahead[(hit == &readahead[0]) ? 1 : 0];
+
+        readahead_wait(entry);
+        entry->block = block + 1;
+        entry->pending = TRUE;
+        entry->req.data = readahead_buf[entry - readahead];
+        entry->req.spare = (spare != NULL) ? readahead_spare_buf[entry - readahead] : NULL;
+        submit_card_request(&entry->req, CARD_READ, block + 1);
+    }
+
+    last_read_block = block;
+
+    return data;
+}
+
+// returns -ve to stop the stream
+typedef s32 (*ChunkFunc)(u8 *data, u32 size, void *arg);
+
+// returns the fd, or -ve on error
+s32 open_file(const char *filename, u32 *size) {
     s32 ret;
 
     OSBbStatBuf stat;
     s32 fd;
-    u32 offset;
+
+    fd = osBbFOpen(filename, "r");
+    if (fd < 0) {
+        return fd;
+    }
+
+    ret = osBbFStat(fd, &stat, NULL, 0);
+    if (ret < 0) {
+        osBbFClose(fd);
+        return ret;
+    }
+
+    *size = stat.size;
+
+    return fd;
+}
+
+// feeds the first size bytes of an open file to func a chunk at a time
+// the card worker reads the next chunks into the other buffers while func works on one
+// returns -ve if a read or func failed
+s32 stream_fd(s32 fd, u32 size, ChunkFunc func, void *arg) {
+    s32 ret = 0;
+    u32 offset = 0;
+    u32 in_flight = 0;
+
+    for (u32 i = 0; (i < NUM_STREAM_BUFS) && (offset < size); i++, in_flight++) {
+        u32 chunk = MIN(size - offset, BYTES_PER_BLOCK);
+
+        card_req[i].data = stream_buf[i];
+        submit_file_read(&card_req[i], fd, offset, chunk);
+        offset += chunk;
+    }
+
+    while (in_flight > 0) {
+        CardRequest *req = wait_card_request();
+        in_flight--;
+
+        // stop queueing on error, but let anything in flight finish
+        if (req->ret < 0) {
+            ret = req->ret;
+        }
+        if (ret < 0) {
+            continue;
+        }
+
+        ret = func(req->data, req->size, arg);
+        if (ret < 0) {
+            continue;
+        }
+
+        if (offset < size) {
+            u32 chunk = MIN(size - offset, BYTES_PER_BLOCK);
+
+            submit_file_read(req, fd, offset, chunk);
+            offset += chunk;
+            in_flight++;
+        }
+    }
+
+    return ret;
+}
+
+// feeds the first size bytes of the file (or all of it, if it's shorter) to func
+// returns the number of bytes read, or -ve on error
+s32 stream_file(const char *filename, u32 size, ChunkFunc func, void *arg) {
+    s32 ret;
+    s32 fd;
+    u32 file_size;
+
+    fd = open_file(filename, &file_size);
+    if (fd < 0) {
+        return fd;
+    }
+
+    size = MIN(size, file_size);
+
+    ret = stream_fd(fd, size, func, arg);
+
+    osBbFClose(fd);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return size;
+}
+
+s32 checksum_chunk(u8 *data, u32 size, void *arg) {
+    u32 *checksum = arg;
+
+    *checksum = update_checksum(data, size, *checksum);
+
+    return 0;
+}
+
+s32 checksum_file(const char *filename, u32 size, u32 expected_checksum) {
+    s32 ret;
     u32 computed_checksum = 0;
-    u32 block_size;
-    u32 remaining;
 
-    fd = osBbFOpen(filename, "r");
+    ret = stream_file(filename, size, checksum_chunk, &computed_checksum);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return (expected_checksum == computed_checksum) ? 0 : 1;
+}
+
+s32 sha1_chunk(u8 *data, u32 size, void *arg) {
+    return SHA1Input(arg, data, size);
+}
+
+// unlike the checksum, this covers the whole file and catches blocks being swapped around
+s32 sha1_file(const char *filename, u8 *digest) {
+    s32 ret;
+    SHA1Context ctx;
+
+    SHA1Reset(&ctx);
+
+    ret = stream_file(filename, 0xFFFFFFFF, sha1_chunk, &ctx);
+    if (ret < 0) {
+        return ret;
+    }
+
+    SHA1Result(&ctx, digest);
+
+    return ret;
+}
+
+// sends a chunk padded to a whole word, counting what's gone out in *arg
+s32 send_chunk(u8 *data, u32 size, void *arg) {
+    u32 *sent = arg;
+    s32 ret;
+
+    ret = osBbWriteHost(data, ALIGN(size, 4));
+    if (ret < 0) {
+        return ret;
+    }
+
+    *sent += ALIGN(size, 4);
+
+    return ret;
+}
+
+// sends the whole of an open file; if reading it fails partway, zeroes go out in place of the rest
+// returns -ve if reading or sending failed
+s32 send_file(s32 fd, u32 size) {
+    s32 ret;
+    u32 sent = 0;
+
+    ret = stream_fd(fd, size, send_chunk, &sent);
+
+    while (sent < ALIGN(size, 4)) {
+        u32 chunk = MIN(ALIGN(size, 4) - sent, BYTES_PER_BLOCK);
+        s32 usb_ret;
+
+        bzero(block_buf, chunk);
+        usb_ret = osBbWriteHost(block_buf, chunk);
+        if (usb_ret < 0) {
+            return usb_ret;
+        }
+        sent += chunk;
+    }
+
+    return ret;
+}
+
+// receives size bytes (a whole number of blocks) into an open file, writing each block while the next comes in
+// the host sends the lot regardless, so everything is received even once a write has failed
+// returns -ve if receiving or writing failed
+s32 recv_file(s32 fd, u32 size) {
+    s32 ret = 0;
+    u32 offset = 0;
+    u32 submitted = 0;
+    u32 done = 0;
+
+    for (u32 i = 0; i < NUM_STREAM_BUFS; i++) {
+        card_req[i].data = stream_buf[i];
+    }
+
+    while (offset < size) {
+        CardRequest *req = &card_req[submitted % NUM_STREAM_BUFS];
+        s32 usb_ret;
+
+        // requests complete in order, so this frees up req
+        if ((submitted - done) == NUM_STREAM_BUFS) {
+            CardRequest *finished = wait_card_request();
+
+            done++;
+            if (finished->ret < 0) {
+                ret = finished->ret;
+            }
+        }
+
+        usb_ret = osBbReadHost(req->data, BYTES_PER_BLOCK);
+        if (usb_ret < 0) {
+            ret = usb_ret;
+            break;
+        }
+        offset += BYTES_PER_BLOCK;
+
+        if (ret < 0) {
+            continue;
+        }
+
+        submit_file_write(req, fd, offset - BYTES_PER_BLOCK, BYTES_PER_BLOCK);
+        submitted++;
+    }
+
+    while (done < submitted) {
+        CardRequest *finished = wait_card_request();
+
+        done++;
+        if ((finished->ret < 0) && (ret >= 0)) {
+            ret = finished->ret;
+        }
+    }
+
+    return ret;
+}
+
+// new files are written under this name and only renamed into place once they're complete
+#define TEMP_FILENAME "montemp.tmp"
+// the file being replaced is kept under this name until the new one has taken its place
+#define BACKUP_FILENAME "monback.tmp"
+
+// renames the finished TEMP_FILENAME to name, keeping any existing file as BACKUP_FILENAME until then
+// returns -ve if it fails; if the rename into place failed, the original is put back and the new file stays as
+// TEMP_FILENAME, and if only deleting the backup failed, the new file is in place but the original is left as
+// BACKUP_FILENAME (which stops the next replace, rather than overwriting it)
+s32 replace_file(const char *name) {
+    s32 fd;
+    s32 ret;
+
+    fd = osBbFOpen(name, "r");
     if (fd < 0) {
-        return fd;
+        // nothing to replace
+        return osBbFRename(TEMP_FILENAME, name);
     }
+    osBbFClose(fd);
 
-    ret = osBbFStat(fd, &stat, NULL, 0);
+    ret = osBbFRename(name, BACKUP_FILENAME);
     if (ret < 0) {
         return ret;
     }
 
-    remaining = size;
-    if (stat.size < remaining) {
-        remaining = stat.size;
+    ret = osBbFRename(TEMP_FILENAME, name);
+    if (ret < 0) {
+        osBbFRename(BACKUP_FILENAME, name);
+        return ret;
     }
 
-    offset = 0;
-    while (remaining > 0) {
-        bzero(block_buf, sizeof(block_buf));
-        osInvalDCache(block_buf, sizeof(block_buf));
+    return osBbFDelete(BACKUP_FILENAME);
+}
 
-        block_size = MIN(remaining, sizeof(block_buf));
+// reads a filename of the given length from the host into filename_buf
+s32 recv_filename(u32 length) {
+    s32 ret;
 
-        ret = osBbFRead(fd, offset, block_buf, block_size);
-        if (ret < 0) {
-            return ret;
+    length = MIN(ALIGN(length, 4), sizeof(filename_buf));
+
+    ret = osBbReadHost(filename_buf, length);
+
+    // ensure null-terminated
+    filename_buf[ARRLEN(filename_buf) - 1] = 0;
+
+    return ret;
+}
+
+// fills buf with the osBbFStatFs totals followed by an entry for each file, straight from the FAT in memory
+// returns the number of files, or -ve if the filesystem isn't usable
+s32 list_files(u8 *buf) {
+    BbFat *fat = (BbFat *)fs.root;
+    FsListEntry *entries = (FsListEntry *)(buf + sizeof(OSBbStatFs));
+    s32 ret;
+    s32 count = 0;
+
+    ret = osBbFStatFs((OSBbStatFs *)buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (u32 i = 0; i < BB_INODES; i++) {
+        BbInode *inode = &fat->inode[i];
+        FsListEntry *entry;
+
+        // unused inodes have no name
+        if (inode->name[0] == 0) {
+            continue;
         }
-        remaining -= block_size;
-        offset += block_size;
-        computed_checksum = update_checksum(block_buf, block_size, computed_checksum);
+
+        entry = &entries[count++];
+        bcopy(inode->name, entry->name, sizeof(entry->name));
+        bcopy(inode->ext, entry->ext, sizeof(entry->ext));
+        entry->type = inode->type;
+        entry->size = inode->size;
+        entry->blocks = ALIGN(inode->size, BYTES_PER_BLOCK) / BYTES_PER_BLOCK;
+        entry->block = inode->block;
     }
 
-    return (expected_checksum == computed_checksum) ? 0 : 1;
+    return count;
 }
 
 typedef enum {
@@ -153,8 +1189,128 @@ typedef enum {
     CMD_SET_TIME = 0x1E,
     CMD_GET_BBID = 0x1F,
     CMD_SIGN_HASH = 0x20,
+
+    CMD_GET_TRACE = 0x40,
+    CMD_READ_BLOCKS = 0x41,
+    CMD_WRITE_BLOCKS = 0x42,
+    CMD_NAND_BAD_BITMAP = 0x43,
+    CMD_HASH_BLOCKS = 0x44,
+    CMD_SET_XFER_MODE = 0x45,
+    CMD_GET_XFER_STATS = 0x46,
+    CMD_WRITE_BLOCK_IF_CHANGED = 0x47,
+    CMD_FILE_SHA1 = 0x48,
+    CMD_BATCH = 0x49,
+    CMD_FILE_READ = 0x4A,
+    CMD_FILE_WRITE = 0x4B,
+    CMD_FS_LIST = 0x4C,
 } CmdId;
 
+s32 card_present;
+u32 card_seqno = 0;
+
+// handles any command that takes nothing but its 8 bytes in and sends nothing but its 8 bytes out
+// these can be run on their own or as part of a CMD_BATCH; returns -1 (leaving out alone) for anything else
+s32 simple_command(u32 *in, u32 *out) {
+    switch (in[0]) {
+        case CMD_SET_LED:
+            {
+                u32 led_value;
+
+                stop_led_thread();
+
+                led_value = in[1] & 3;
+
+                if ((led_value == 0) || (led_value == 1)) {
+                    osBbSetErrorLed(0);
+                } else if (led_value == 2) {
+                    osBbSetErrorLed(1);
+                } else if (led_value == 3) {
+                    start_led_thread();
+                }
+                out[1] = 0;
+                break;
+            }
+
+        case CMD_INIT_FS:
+            out[1] = osBbFInit(&fs);
+            break;
+
+        case CMD_CARD_SIZE:
+            out[1] = osBbCardBlocks(0);
+            break;
+
+        case CMD_SET_SEQ_NUM:
+            card_seqno = card_present ? in[1] : 0;
+            out[1] = card_seqno;
+            break;
+
+        case CMD_GET_SEQ_NUM:
+            if (card_present == 0) {
+                out[1] = __UINT32_MAX__;
+            } else {
+                out[1] = card_seqno;
+            }
+            break;
+
+        case CMD_GET_BBID:
+            skGetId(&out[1]);
+            break;
+
+        case CMD_SET_XFER_MODE:
+            // the host asks for a set of features and gets back the ones that will be used
+            xfer_mode = in[1] & XFER_SUPPORTED;
+            out[1] = xfer_mode;
+            break;
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+// the most commands one batch will run; any more are read and dropped
+#define BATCH_MAX (BYTES_PER_BLOCK / 8)
+
+// runs count commands (already sent by the host after the CMD_BATCH words) in order, replying in place
+// each reply is what the command would have sent on its own, or ~0 in the second word if it can't be batched
+// returns the number run, or -ve on a USB error
+s32 run_batch(u32 count) {
+    s32 ret;
+    u32 (*cmds)[2] = (u32(*)[2])block_buf;
+    u32 run = MIN(count, BATCH_MAX);
+
+    ret = osBbReadHost(cmds, run * sizeof(cmds[0]));
+    if (ret < 0) {
+        return ret;
+    }
+
+    // keep in step with the host if it sent too many
+    for (u32 dropped = run; dropped < count;) {
+        u32 chunk = MIN(count - dropped, BATCH_MAX);
+
+        ret = osBbReadHost(stream_buf[0], chunk * sizeof(cmds[0]));
+        if (ret < 0) {
+            return ret;
+        }
+        dropped += chunk;
+    }
+
+    for (u32 i = 0; i < run; i++) {
+        u32 in[2];
+
+        in[0] = cmds[i][0];
+        in[1] = cmds[i][1];
+
+        cmds[i][0] = 0xFF - in[0];
+        if (simple_command(in, cmds[i]) < 0) {
+            cmds[i][1] = __UINT32_MAX__;
+        }
+    }
+
+    return run;
+}
+
 s32 mon(void) {
     s32 ret = 0;
 
@@ -162,9 +1318,7 @@ s32 mon(void) {
     u32 data_out[2];
     u8 status;
 
-    s32 card_present;
     s32 card_changed;
-    u32 card_seqno = 0;
 
     fbClear();
 
@@ -177,6 +1331,9 @@ s32 mon(void) {
         osBbFInit(&fs);
     }
 
+    start_card_thread();
+    readahead_flush();
+
     card_present = osBbCardClearChange();
     flash_led(100000);
 
@@ -190,6 +1347,9 @@ s32 mon(void) {
             continue;
         }
 
+        // a read-ahead may still be in the driver; it's kept unless the card changed
+        readahead_settle();
+
         osBbCardStatus(0, &status);
         card_changed = osBbCardChange();
         if (card_changed) {
@@ -197,6 +1357,14 @@ s32 mon(void) {
             if (card_present) {
                 osBbCardInit();
             }
+            // it might not be the same card
+            reset_bad_block_table();
+            readahead_flush();
+        }
+
+        // anything but another single block read could write the card or need the card thread
+        if ((data_in[0] != CMD_READ_BLOCK) && (data_in[0] != CMD_READ_BLOCK_WITH_SPARE)) {
+            readahead_flush();
         }
 
         data_out[0] = 0xFF - data_in[0];
@@ -205,44 +1373,112 @@ s32 mon(void) {
         switch (data_in[0]) {
             case CMD_FILE_CHECKSUM:
                 {
-                    u32 length = ALIGN(data_in[1], 4);
+                    ret = recv_filename(data_in[1]);
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    data_out[1] = (checksum_file(filename_buf, data_in[1], data_in[0]) == 0) ? 0 : -1;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    break;
+                }
 
-                    length = MIN(length, sizeof(filename_buf));
+            case CMD_FILE_SHA1:
+                {
+                    BbShaHash digest;
 
-                    ret = osBbReadHost(filename_buf, length);
+                    ret = recv_filename(data_in[1]);
                     if (ret < 0) {
                         break;
                     }
 
-                    // ensure null-terminated
-                    filename_buf[ARRLEN(filename_buf) - 1] = 0;
+                    // the number of bytes hashed, or -ve if the file couldn't be read
+                    data_out[1] = sha1_file(filename_buf, (u8 *)digest);
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if ((ret < 0) || ((s32)data_out[1] < 0)) {
+                        break;
+                    }
 
-                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    ret = osBbWriteHost(digest, sizeof(digest));
+                    break;
+                }
+
+            case CMD_FILE_READ:
+                {
+                    // replies with the size (or -ve), then sends the contents padded to a word, then a final status
+                    s32 fd;
+                    u32 size;
+
+                    ret = recv_filename(data_in[1]);
                     if (ret < 0) {
                         break;
                     }
 
-                    data_out[1] = (checksum_file(filename_buf, data_in[1], data_in[0]) == 0) ? 0 : -1;
+                    fd = open_file(filename_buf, &size);
+                    data_out[1] = (fd < 0) ? (u32)fd : size;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if ((ret < 0) || (fd < 0)) {
+                        if (fd >= 0) {
+                            osBbFClose(fd);
+                        }
+                        break;
+                    }
+
+                    data_out[1] = send_file(fd, size);
+                    osBbFClose(fd);
+
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     break;
                 }
 
-            case CMD_SET_LED:
+            case CMD_FILE_WRITE:
                 {
-                    u32 led_value;
+                    // after the filename, the host sends (size, type) and waits for the file to be created (0 or
+                    // -ve), then sends the contents and gets a final status
+                    // files take whole blocks, so the size has to be a multiple of the block size
+                    s32 fd = -1;
+
+                    ret = recv_filename(data_in[1]);
+                    if (ret < 0) {
+                        break;
+                    }
 
-                    stop_led_thread();
+                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    if (ret < 0) {
+                        break;
+                    }
 
-                    led_value = data_in[1] & 3;
+                    // any existing file is left alone until the new one is completely written
+                    if ((data_in[0] % BYTES_PER_BLOCK) == 0) {
+                        osBbFDelete(TEMP_FILENAME);
+                        fd = osBbFCreate(TEMP_FILENAME, data_in[1], data_in[0]);
+                    }
 
-                    if ((led_value == 0) || (led_value == 1)) {
-                        osBbSetErrorLed(0);
-                    } else if (led_value == 2) {
-                        osBbSetErrorLed(1);
-                    } else if (led_value == 3) {
-                        start_led_thread();
+                    data_out[1] = (fd < 0) ? (u32)fd : 0;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if ((ret < 0) || (fd < 0)) {
+                        if (fd >= 0) {
+                            osBbFClose(fd);
+                            osBbFDelete(TEMP_FILENAME);
+                        }
+                        break;
                     }
-                    data_out[1] = 0;
+
+                    data_out[1] = recv_file(fd, data_in[0]);
+                    osBbFClose(fd);
+
+                    if ((s32)data_out[1] < 0) {
+                        // don't leave a partly written file behind
+                        osBbFDelete(TEMP_FILENAME);
+                    } else {
+                        data_out[1] = replace_file(filename_buf);
+                    }
+
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     break;
                 }
@@ -278,20 +1514,43 @@ s32 mon(void) {
 
             case CMD_WRITE_BLOCK:
                 {
-                    ret = osBbReadHost(block_buf, sizeof(block_buf));
+                    s32 fill;
+
+                    ret = recv_block_payload(block_buf, &fill);
                     if (ret < 0) {
                         break;
                     }
 
-                    osBbCardEraseBlock(0, data_in[1]);
-                    data_out[1] = osBbCardWriteBlock(0, data_in[1], block_buf, NULL);
+                    data_out[1] = write_card_block(data_in[1], block_buf, NULL, fill);
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     break;
                 }
 
             case CMD_WRITE_BLOCK_WITH_SPARE:
                 {
-                    ret = osBbReadHost(block_buf, sizeof(block_buf));
+                    s32 fill;
+
+                    ret = recv_block_payload(block_buf, &fill);
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = osBbReadHost(spare_buf, sizeof(spare_buf));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    data_out[1] = write_card_block(data_in[1], block_buf, spare_buf, fill);
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    break;
+                }
+
+            case CMD_WRITE_BLOCK_IF_CHANGED:
+                {
+                    // like CMD_WRITE_BLOCK_WITH_SPARE, but replies WRITE_SKIPPED if the block was left alone
+                    s32 fill;
+
+                    ret = recv_block_payload(block_buf, &fill);
                     if (ret < 0) {
                         break;
                     }
@@ -301,33 +1560,38 @@ s32 mon(void) {
                         break;
                     }
 
-                    osBbCardEraseBlock(0, data_in[1]);
-                    data_out[1] = osBbCardWriteBlock(0, data_in[1], block_buf, spare_buf);
+                    data_out[1] = write_card_block_if_changed(data_in[1], block_buf, spare_buf, fill);
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     break;
                 }
 
             case CMD_READ_BLOCK:
                 {
-                    data_out[1] = osBbCardReadBlock(0, data_in[1], block_buf, NULL);
+                    s32 status;
+                    u8 *data = read_block_cached(data_in[1], NULL, &status);
+
+                    data_out[1] = status;
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     if (ret < 0) {
                         break;
                     }
 
-                    ret = osBbWriteHost(block_buf, sizeof(block_buf));
+                    ret = send_read_block(data);
                     break;
                 }
 
             case CMD_READ_BLOCK_WITH_SPARE:
                 {
-                    data_out[1] = osBbCardReadBlock(0, data_in[1], block_buf, spare_buf);
+                    s32 status;
+                    u8 *data = read_block_cached(data_in[1], spare_buf, &status);
+
+                    data_out[1] = status;
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     if (ret < 0) {
                         break;
                     }
 
-                    ret = osBbWriteHost(block_buf, sizeof(block_buf));
+                    ret = send_read_block(data);
                     if (ret < 0) {
                         break;
                     }
@@ -338,13 +1602,18 @@ s32 mon(void) {
 
             case CMD_NAND_BLOCK_STATS:
                 {
-                    u32 num_blocks = osBbCardBlocks(0);
+                    u32 num_blocks = MIN(osBbCardBlocks(0), NAND_MAX_BLOCKS);
+                    u8 *bitmap;
+                    u8 *status;
 
+                    // only blocks that haven't been looked at since the last card change or write get read
+                    if (scan_bad_blocks(num_blocks, &bitmap, &status) != 0) {
+                        num_blocks = 0;
+                    }
+
+                    // this command has always counted a block as bad if any bit of its status byte is clear
                     for (u32 i = 0; i < num_blocks; i++) {
-                        spare_buf[5] = 0xFF;
-                        osBbCardReadBlock(0, i, block_buf, spare_buf);
-                        // indicates a bad block
-                        bad_buf[i] = (spare_buf[5] != 0xFF);
+                        bad_buf[i] = (status[i] != 0xFF);
                     }
 
                     data_out[1] = num_blocks;
@@ -358,43 +1627,28 @@ s32 mon(void) {
                     break;
                 }
 
-            case CMD_INIT_FS:
+            case CMD_NAND_BAD_BITMAP:
                 {
-                    data_out[1] = osBbFInit(&fs);
-                    ret = osBbWriteHost(data_out, sizeof(data_out));
-                    break;
-                }
+                    // like CMD_NAND_BLOCK_STATS, but 1 bit per block rather than 1 byte, and a block only counts as
+                    // bad if 2 or more bits of its status byte are clear, as the loader decides
+                    u32 num_blocks = MIN(osBbCardBlocks(0), NAND_MAX_BLOCKS);
+                    u8 *bitmap;
 
-            case CMD_CARD_SIZE:
-                {
-                    data_out[1] = osBbCardBlocks(0);
-                    ret = osBbWriteHost(data_out, sizeof(data_out));
-                    break;
-                }
+                    if (scan_bad_blocks(num_blocks, &bitmap, NULL) != 0) {
+                        num_blocks = 0;
+                    }
 
-            case CMD_SET_SEQ_NUM:
-                {
-                    card_seqno = card_present ? data_in[1] : 0;
-                    data_out[1] = card_seqno;
-                    ret = osBbWriteHost(data_out, sizeof(data_out));
-                    break;
-                }
+                    data_out[1] = num_blocks;
 
-            case CMD_GET_SEQ_NUM:
-                {
-                    if (card_present == 0) {
-                        data_out[1] = __UINT32_MAX__;
-                    } else {
-                        data_out[1] = card_seqno;
-                    }
                     ret = osBbWriteHost(data_out, sizeof(data_out));
-                    break;
-                }
+                    if (ret < 0) {
+                        break;
+                    }
 
-            case CMD_GET_BBID:
-                {
-                    skGetId(&data_out[1]);
-                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    // bit n % 8 of byte n / 8, padded out to a whole word
+                    if (num_blocks > 0) {
+                        ret = osBbWriteHost(bitmap, ALIGN(num_blocks, 32) / 8);
+                    }
                     break;
                 }
 
@@ -443,9 +1697,144 @@ s32 mon(void) {
                     break;
                 }
 
+            case CMD_READ_BLOCKS:
+                {
+                    u32 start = data_in[1];
+                    u32 num_blocks = osBbCardBlocks(0);
+                    u32 count;
+
+                    // followed by the number of blocks and the flags
+                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    count = (start < num_blocks) ? MIN(data_in[0], num_blocks - start) : 0;
+
+                    data_out[1] = count;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = stream_read_blocks(start, count, data_in[1]);
+                    break;
+                }
+
+            case CMD_WRITE_BLOCKS:
+                {
+                    u32 start = data_in[1];
+                    u32 num_blocks = MIN(osBbCardBlocks(0), NAND_MAX_BLOCKS);
+                    u32 count;
+
+                    // followed by the number of blocks and the flags
+                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    count = (start < num_blocks) ? MIN(data_in[0], num_blocks - start) : 0;
+
+                    data_out[1] = count;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = stream_write_blocks(start, count, data_in[1]);
+                    break;
+                }
+
+            case CMD_HASH_BLOCKS:
+                {
+                    u32 start = data_in[1];
+                    u32 num_blocks = osBbCardBlocks(0);
+                    u32 count;
+
+                    // followed by the number of blocks and the flags
+                    ret = osBbReadHost(data_in, sizeof(data_in));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    count = (start < num_blocks) ? MIN(data_in[0], num_blocks - start) : 0;
+
+                    data_out[1] = count;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = hash_blocks(start, count, data_in[1]);
+                    break;
+                }
+
+            case CMD_GET_XFER_STATS:
+                {
+                    data_out[1] = sizeof(xfer_stats);
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = osBbWriteHost(&xfer_stats, sizeof(xfer_stats));
+                    break;
+                }
+
+            case CMD_BATCH:
+                {
+                    s32 run = run_batch(data_in[1]);
+
+                    if (run < 0) {
+                        ret = run;
+                        break;
+                    }
+
+                    data_out[1] = run;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if ((ret < 0) || (run == 0)) {
+                        break;
+                    }
+
+                    ret = osBbWriteHost(block_buf, run * sizeof(data_out));
+                    break;
+                }
+
+            case CMD_FS_LIST:
+                {
+                    // replies with the number of files (or -ve), then sends the totals and the entries in one go
+                    s32 count = list_files(block_buf);
+
+                    data_out[1] = count;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if ((ret < 0) || (count < 0)) {
+                        break;
+                    }
+
+                    ret = osBbWriteHost(block_buf, sizeof(OSBbStatFs) + count * sizeof(FsListEntry));
+                    break;
+                }
+
+            case CMD_GET_TRACE:
+                {
+                    // the trace lives in uncached RAM outside SA1, so send a copy
+                    bcopy(trace_buffer, block_buf, TRACE_SIZE);
+
+                    data_out[1] = TRACE_SIZE;
+                    ret = osBbWriteHost(data_out, sizeof(data_out));
+                    if (ret < 0) {
+                        break;
+                    }
+
+                    ret = osBbWriteHost(block_buf, TRACE_SIZE);
+                    break;
+                }
+
             default:
                 {
-                    data_out[1] = __UINT32_MAX__;
+                    if (simple_command(data_in, data_out) < 0) {
+                        data_out[1] = __UINT32_MAX__;
+                    }
                     ret = osBbWriteHost(data_out, sizeof(data_out));
                     break;
                 }
@@ -0,0 +1,238 @@
+#include <bbtypes.h>
+#include <macros.h>
+
+#include "blocks.h"
+#include "nand.h"
+#include "trace.h"
+
+void osBbCardInit(void);
+
+// full page read: 512 bytes of data plus 16 bytes of spare, with ECC
+#define NAND_CMD_READ_PAGE (0x9F008A10)
+// spare-only read: same address phases, NAND command 0x50 and a 16 byte transfer with ECC off
+// not yet confirmed on hardware to land in PI_10400_REG/PI_10404_REG, so it's only used with NAND_SPARE_READS
+#define NAND_CMD_READ_SPARE (0x9F508010)
+
+// bad block table, filled in a block at a time from read_spare the first time each block is looked at
+// a block's bit in bbt_bad and its status byte only mean anything once its bit in bbt_known is set
+u8 bbt_known[NAND_MAX_BLOCKS / 8];
+u8 bbt_bad[NAND_MAX_BLOCKS / 8];
+// raw status byte (spare byte 5), for callers with their own idea of what counts as bad
+u8 bbt_status[NAND_MAX_BLOCKS];
+
+#define BBT_TEST(map, block) ((map)[(block) >> 3] & (1 << ((block) & 7)))
+#define BBT_SET(map, block) ((map)[(block) >> 3] |= (1 << ((block) & 7)))
+#define BBT_CLEAR(map, block) ((map)[(block) >> 3] &= ~(1 << ((block) & 7)))
+
+// raise OS_EVENT_FLASH when the command completes
+#define NAND_CMD_INTR (0x40000000)
+
+OSMesgQueue nand_mesg_queue;
+OSMesg nand_mesg_buf[2];
+
+s32 nand_interrupts = FALSE;
+
+// takes over the flash and card events from whatever had them (osBbFInit/osBbCardInit), until release_nand_interrupts
+void claim_nand_interrupts(void) {
+    osCreateMesgQueue(&nand_mesg_queue, nand_mesg_buf, ARRLEN(nand_mesg_buf));
+
+    osSetEventMesg(OS_EVENT_FLASH, &nand_mesg_queue, (OSMesg)OS_EVENT_FLASH);
+    // the card being pulled also has to wake a waiting read
+    osSetEventMesg(OS_EVENT_MD, &nand_mesg_queue, (OSMesg)OS_EVENT_MD);
+
+    nand_interrupts = TRUE;
+}
+
+// goes back to polling and hands the events back to the card driver
+// there's no way to read back what was registered before, so the SDK's card init is run again to set up whatever it
+// wants; the events are unregistered first so none are left pointing at nand_mesg_queue
+void release_nand_interrupts(void) {
+    nand_interrupts = FALSE;
+
+    osSetEventMesg(OS_EVENT_FLASH, NULL, 0);
+    osSetEventMesg(OS_EVENT_MD, NULL, 0);
+    osBbCardInit();
+}
+
+static s32 nand_wait_interrupt(u32 cmd) {
+    OSMesg mesg;
+
+    // drop anything left over from before this command, e.g. a card event while nothing was waiting
+    while (osRecvMesg(&nand_mesg_queue, NULL, OS_MESG_NOBLOCK) == 0)
+        ;
+
+    IO_WRITE(PI_48_REG, cmd | NAND_CMD_INTR);
+
+    osRecvMesg(&nand_mesg_queue, &mesg, OS_MESG_BLOCK);
+
+    if (((s32)mesg == OS_EVENT_MD) || (IO_READ(MI_38_REG) & 0x02000000)) {
+        IO_WRITE(PI_48_REG, 0);
+        return 2;
+    }
+
+    return 0;
+}
+
+static s32 nand_wait_poll(u32 cmd) {
+    IO_WRITE(PI_48_REG, cmd);
+
+    do {
+        if (IO_READ(MI_38_REG) & 0x02000000) {
+            IO_WRITE(PI_48_REG, 0);
+            return 2;
+        }
+    } while (IO_READ(PI_48_REG) & 0x80000000);
+
+    return 0;
+}
+
+s32 nand_read(u32 page, u32 cmd) {
+    s32 ret;
+
+    IO_WRITE(PI_70_REG, page * BYTES_PER_PAGE);
+
+    if (nand_interrupts) {
+        ret = nand_wait_interrupt(cmd);
+    } else {
+        ret = nand_wait_poll(cmd);
+    }
+    if ((ret == 0) && (IO_READ(PI_48_REG) & 0x00000400)) {
+        ret = 1;
+    }
+
+    if (ret) {
+        trace_event(TRACE_NAND_ERROR, page, ret);
+    }
+
+    return ret;
+}
+
+s32 read_page(u32 page) {
+    return nand_read(page, NAND_CMD_READ_PAGE);
+}
+
+// fills the spare buffer (PI_10400_REG/PI_10404_REG)
+// the default build still reads (and ECC checks) the whole page for this, overwriting the page buffer; only a build
+// with NAND_SPARE_READS (off in the Makefile until it's been checked on hardware) reads the spare alone
+s32 read_spare(u32 page) {
+#ifdef NAND_SPARE_READS
+    return nand_read(page, NAND_CMD_READ_SPARE);
+#else
+    return nand_read(page, NAND_CMD_READ_PAGE);
+#endif
+}
+
+s32 block_link(u32 spare) {
+    // the link is stored in the spare data 3 times, so get the best 2 of 3
+    u8 a = (spare >> 8), b = (spare >> 16), c = (spare >> 24);
+    if (a == b) {
+        return a;
+    } else {
+        return c;
+    }
+}
+
+// a block is bad if 2 or more bits of its status byte (spare byte 5) are clear
+static s32 block_status_bad(u32 spare) {
+    s32 num_bad_bits = 0;
+
+    for (u32 i = 0; i < 8; i++) {
+        if (((spare >> (i + 16)) & 1) == 0) {
+            num_bad_bits++;
+        }
+    }
+
+    return num_bad_bits >= 2;
+}
+
+s32 lookup_block(u16 block, u8 *bad) {
+    s32 ret;
+    u32 spare;
+
+    if ((block < NAND_MAX_BLOCKS) && BBT_TEST(bbt_known, block)) {
+        *bad = BBT_TEST(bbt_bad, block) != 0;
+        return 0;
+    }
+
+    // the block status byte lives in the spare (a whole page read unless built with NAND_SPARE_READS)
+    ret = read_spare(block * PAGES_PER_BLOCK);
+    if (ret == 2) {
+        return ret;
+    }
+
+    spare = IO_READ(PI_10404_REG);
+    *bad = block_status_bad(spare);
+
+    if (block < NAND_MAX_BLOCKS) {
+        bbt_status[block] = spare >> 16;
+        if (*bad) {
+            BBT_SET(bbt_bad, block);
+        } else {
+            BBT_CLEAR(bbt_bad, block);
+        }
+        // only trust it next time if the read was clean
+        if (ret == 0) {
+            BBT_SET(bbt_known, block);
+        }
+    }
+
+    return ret;
+}
+
+void forget_block(u16 block) {
+    if (block < NAND_MAX_BLOCKS) {
+        BBT_CLEAR(bbt_known, block);
+    }
+}
+
+void reset_bad_block_table(void) {
+    bzero(bbt_known, sizeof(bbt_known));
+}
+
+// makes sure the first num_blocks blocks are all in the table, then hands back the bad bitmap (block n is bit n % 8 of
+// byte n / 8) and the status bytes (if status isn't NULL)
+s32 scan_bad_blocks(u32 num_blocks, u8 **bitmap, u8 **status) {
+    s32 ret;
+    u8 bad;
+
+    num_blocks = MIN(num_blocks, NAND_MAX_BLOCKS);
+
+    for (u32 i = 0; i < num_blocks; i++) {
+        ret = lookup_block(i, &bad);
+        if (ret == 2) {
+            return ret;
+        }
+    }
+
+    *bitmap = bbt_bad;
+    if (status != NULL) {
+        *status = bbt_status;
+    }
+
+    return 0;
+}
+
+s32 find_next_good_block(u16 *out_block, u16 start_block) {
+    s32 ret;
+    u8 bad;
+
+    while (TRUE) {
+        ret = lookup_block(start_block, &bad);
+        if (ret == 2) {
+            // fatal error
+            return 1;
+        }
+
+        start_block++;
+
+        if (!bad) {
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        *out_block = start_block - 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef _NAND_H
+#define _NAND_H
+
+#include <ultra64.h>
+
+// largest card the bad block table covers
+#define NAND_MAX_BLOCKS (16384)
+
+void claim_nand_interrupts(void);
+void release_nand_interrupts(void);
+s32 read_page(u32 page);
+s32 read_spare(u32 page);
+s32 block_link(u32 spare);
+s32 lookup_block(u16 block, u8 *bad);
+void forget_block(u16 block);
+void reset_bad_block_table(void);
+s32 scan_bad_blocks(u32 num_blocks, u8 **bitmap, u8 **status);
+s32 find_next_good_block(u16 *out_block, u16 start_block);
+
+#endif
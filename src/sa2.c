@@ -1,10 +1,15 @@
 #include <bbtypes.h>
-#include <gzip.h>
 #include <libfb.h>
 #include <macros.h>
+#include <sa1.h>
+#include <sha1.h>
 
 #include "blocks.h"
+#include "decompress.h"
+#include "nand.h"
 #include "sa2.h"
+#include "stack.h"
+#include "trace.h"
 
 extern const void __sa1_end;
 
@@ -19,88 +24,109 @@ u8 cmd_buf[BYTES_PER_BLOCK];
 // sa2's max size is MAX_SKSA_BLOCKS - SK_SIZE - sa1_num_blocks - 2
 u16 sa2_blocks[MAX_SKSA_BLOCKS];
 
-#define BUF_SIZE (1 * 1024 * 1024)
-u8 compressed_buf[BUF_SIZE] __attribute__((aligned(BUF_SIZE), section(".buf")));
-u8 decompressed_buf[BUF_SIZE] __attribute__((aligned(BUF_SIZE), section(".buf")));
+// compressed SA2 is streamed through these a block at a time, so the next block's DMA overlaps decompressing the current one
+#define NUM_DMA_BUFS (2)
+u8 dma_buf[NUM_DMA_BUFS][BYTES_PER_BLOCK] __attribute__((aligned(16)));
+
+OSMesgQueue dma_queue;
+OSMesg dma_mesg_buf[NUM_DMA_BUFS];
+OSIoMesg dma_mesg[NUM_DMA_BUFS];
+OSPiHandle *cart_handle;
+
+InStream sa2_stream;
+u32 sa2_stream_blocks;
+u32 sa2_next_dma;
+u32 sa2_next_read;
+
+// every block is hashed as it arrives, while the next one is still in flight
+SHA1Context sa2_sha1;
+u32 sa2_hash_cycles;
 
 #define N64_ROM_HEADER_SIZE (0x1000)
 #define N64_ROM_HEADER_LOADADDR_OFFSET (8)
 
-#define RAM_END (PHYS_TO_K0(0x00800000))
+// only as much of the header as it takes to find the load address
+u8 header_buf[N64_ROM_HEADER_LOADADDR_OFFSET + sizeof(SA2Entry)] __attribute__((aligned(4)));
 
-s32 read_page(u32 page) {
-    IO_WRITE(PI_70_REG, page * BYTES_PER_PAGE);
+#define RAM_END (PHYS_TO_K0(SA1_RAM_END))
 
-    IO_WRITE(PI_48_REG, 0x9F008A10);
+// the most SA2 can decompress to, the same limit the SDK's expand_gzip was given
+#define SA2_MAX_SIZE (MAX_SKSA_BLOCKS * BYTES_PER_BLOCK)
 
-    do {
-        if (IO_READ(MI_38_REG) & 0x02000000) {
-            IO_WRITE(PI_48_REG, 0);
-            return 2;
-        }
-    } while (IO_READ(PI_48_REG) & 0x80000000);
+// SA2 is loaded in the background while the menu is up, so A can launch it straight away
+OSThread sa2_thread;
+void sa2proc(void *);
+u8 sa2_stack[STACK_SIZE] __attribute__((aligned(STACK_ALIGN)));
 
-    if (IO_READ(PI_48_REG) & 0x00000400) {
-        return 1;
-    }
+OSMesgQueue sa2_done_queue;
+OSMesg sa2_done_buf[1];
 
-    return 0;
-}
+SA2Entry sa2_prefetch_addr;
+s32 sa2_prefetch_running = FALSE;
+// checked at each block and between load stages; a cancelled load fails quietly
+volatile s32 sa2_cancel = FALSE;
 
-s32 block_link(u32 spare) {
-    // the link is stored in the spare data 3 times, so get the best 2 of 3
-    u8 a = (spare >> 8), b = (spare >> 16), c = (spare >> 24);
-    if (a == b) {
-        return a;
-    } else {
-        return c;
-    }
-}
+// the loader can't draw over the menu, so it records why it failed for print_sa2_error
+typedef enum {
+    SA2_ERROR_NONE,
+    SA2_ERROR_DECOMPRESS,
+    SA2_ERROR_HASH,
+} SA2Error;
 
-s32 find_next_good_block(u16 *out_block, u16 start_block) {
-    s32 ret;
-    u32 block_status;
+SA2Error sa2_error;
+s32 sa2_error_code;
 
-    while (TRUE) {
-        s32 num_bad_bits = 0;
+void start_sa2_dma(u32 block) {
+    u8 *buf = dma_buf[block % NUM_DMA_BUFS];
+    OSIoMesg *mesg = &dma_mesg[block % NUM_DMA_BUFS];
 
-        ret = read_page(start_block * PAGES_PER_BLOCK);
-        if (ret == 2) {
-            // fatal error
-            return 1;
-        }
+    osInvalDCache(buf, BYTES_PER_BLOCK);
 
-        block_status = IO_READ(PI_10404_REG);
+    mesg->hdr.pri = OS_MESG_PRI_NORMAL;
+    mesg->hdr.retQueue = &dma_queue;
+    mesg->dramAddr = buf;
+    mesg->devAddr = block * BYTES_PER_BLOCK;
+    mesg->size = BYTES_PER_BLOCK;
+    osEPiStartDma(cart_handle, mesg, OS_READ);
+}
 
-        for (u32 i = 0; i < 8; i++) {
-            if (((block_status >> (i + 16)) & 1) == 0) {
-                num_bad_bits++;
-            }
-        }
+void hash_sa2_block(u8 *buf) {
+    u32 start = osGetCount();
 
-        start_block++;
+    SHA1Input(&sa2_sha1, buf, BYTES_PER_BLOCK);
 
-        if (num_bad_bits < 2) {
-            break;
-        }
+    sa2_hash_cycles += osGetCount() - start;
+}
+
+s32 refill_sa2_stream(InStream *in) {
+    // anything still in flight gets drained by close_sa2_stream
+    if (sa2_cancel) {
+        return 1;
     }
 
-    if (ret == 0) {
-        *out_block = start_block - 1;
+    // the buffer that was just used up is free again, so queue the next block into it
+    if ((sa2_next_read > 0) && (sa2_next_dma < sa2_stream_blocks)) {
+        start_sa2_dma(sa2_next_dma++);
     }
 
-    return ret;
-}
+    if (sa2_next_read == sa2_stream_blocks) {
+        return 1;
+    }
 
-s32 load_sa2_blocks(BbContentMetaDataHead *cmd, u16 *blocks, u32 num_blocks, void *dst) {
-    s32 ret;
+    // DMAs complete in the order they were queued
+    osRecvMesg(&dma_queue, NULL, OS_MESG_BLOCK);
 
-    OSMesgQueue dma_queue;
-    OSIoMesg dma_mesg;
-    OSMesg dma_mesg_buf[1];
-    OSPiHandle *cart_handle;
+    in->next = dma_buf[sa2_next_read % NUM_DMA_BUFS];
+    in->end = in->next + BYTES_PER_BLOCK;
+    sa2_next_read++;
 
-    osCreateMesgQueue(&dma_queue, dma_mesg_buf, ARRLEN(dma_mesg_buf));
+    hash_sa2_block(in->next);
+
+    return 0;
+}
+
+s32 open_sa2_stream(u16 *blocks, u32 num_blocks) {
+    s32 ret;
 
     if (num_blocks == 0) {
         return 1;
@@ -113,67 +139,137 @@ s32 load_sa2_blocks(BbContentMetaDataHead *cmd, u16 *blocks, u32 num_blocks, voi
         return 1;
     }
 
+    osCreateMesgQueue(&dma_queue, dma_mesg_buf, ARRLEN(dma_mesg_buf));
+
     cart_handle = osCartRomInit();
 
     IO_WRITE(PI_48_REG, 0x1F008BFF);
 
-    dma_mesg.hdr.pri = OS_MESG_PRI_NORMAL;
-    dma_mesg.hdr.retQueue = &dma_queue;
-    dma_mesg.dramAddr = dst;
-    dma_mesg.devAddr = 0;
-    dma_mesg.size = num_blocks * BYTES_PER_BLOCK;
-    osEPiStartDma(cart_handle, &dma_mesg, OS_READ);
-
-    osRecvMesg(&dma_queue, NULL, OS_MESG_BLOCK);
+    sa2_stream.next = NULL;
+    sa2_stream.end = NULL;
+    sa2_stream.refill = refill_sa2_stream;
+    sa2_stream_blocks = num_blocks;
+    sa2_next_read = 0;
 
-    osWritebackDCacheAll();
-    // clear 64KiB of instruction cache for some reason????
-    osInvalICache((void *)K0BASE, 64 * 1024);
+    SHA1Reset(&sa2_sha1);
+    sa2_hash_cycles = 0;
 
-    osRomBase = (void *)PHYS_TO_K1(PI_DOM1_ADDR2);
-    osMemSize = 4 * 1024 * 1024;
-    osTvType = OS_TV_NTSC;
+    for (sa2_next_dma = 0; (sa2_next_dma < NUM_DMA_BUFS) && (sa2_next_dma < num_blocks); sa2_next_dma++) {
+        start_sa2_dma(sa2_next_dma);
+    }
 
     return 0;
 }
 
+// the payload usually ends before the content does, so pull in (and hash) the rest before checking it against the CMD
+s32 verify_sa2_stream(BbContentMetaDataHead *cmd) {
+    u8 digest[sizeof(BbShaHash)];
+
+    while (refill_sa2_stream(&sa2_stream) == 0)
+        ;
+
+    SHA1Result(&sa2_sha1, digest);
+
+    return bcmp(digest, cmd->hash, sizeof(digest)) != 0;
+}
+
+void close_sa2_stream(void) {
+    // don't leave any DMAs in flight
+    while (sa2_next_read < sa2_next_dma) {
+        osRecvMesg(&dma_queue, NULL, OS_MESG_BLOCK);
+        sa2_next_read++;
+    }
+}
+
+#define GZIP_MAGIC (0x1F8B)
+
+// the payload format is tagged by its first bytes, which must already be in the stream
+s32 decompress_payload(InStream *in, u8 *out, u32 out_size) {
+    u8 *tag = in->next;
+
+    if (((tag[0] << 8) | tag[1]) == GZIP_MAGIC) {
+        return inflate_gzip(in, out, out_size);
+    }
+
+    if (((tag[3] << 24) | (tag[2] << 16) | (tag[1] << 8) | tag[0]) == LZ4_LEGACY_MAGIC) {
+        return lz4_decompress(in, out, out_size);
+    }
+
+    return DECOMPRESS_ERR_DATA;
+}
+
 s32 decompress_sa2(SA2Entry *loadaddr, BbContentMetaDataHead *cmd, u16 *blocks, u32 num_blocks) {
     s32 ret;
-    u32 decompressed_size;
+    InStream peek;
     void *adjusted_loadaddr;
+    u32 max_size;
 
-    ret = load_sa2_blocks(cmd, blocks, num_blocks, compressed_buf);
+    ret = open_sa2_stream(blocks, num_blocks);
     if (ret) {
         return ret;
     }
 
-    ret = expand_gzip((void *)compressed_buf, (void *)decompressed_buf, cmd->size, MAX_SKSA_BLOCKS * BYTES_PER_BLOCK);
-    if (ret < 0) {
-        fbPrintf(fbRed, 3, 8, "GZIP error: %d", ret);
-        osWritebackDCacheAll();
-
+    // wait for the first block, then decompress just the start of the ROM header out of it to find out where SA2 goes
+    ret = refill_sa2_stream(&sa2_stream);
+    if (ret) {
+        close_sa2_stream();
         return 1;
     }
 
-    decompressed_size = ret;
+    peek.next = sa2_stream.next;
+    peek.end = sa2_stream.end;
+    peek.refill = NULL;
 
-    if (decompressed_size < N64_ROM_HEADER_SIZE) {
+    ret = decompress_payload(&peek, header_buf, sizeof(header_buf));
+    if (ret != DECOMPRESS_ERR_OUTPUT) {
+        close_sa2_stream();
         return 1;
     }
 
-    *loadaddr = *(SA2Entry *)(decompressed_buf + N64_ROM_HEADER_LOADADDR_OFFSET);
+    *loadaddr = *(SA2Entry *)(header_buf + N64_ROM_HEADER_LOADADDR_OFFSET);
     adjusted_loadaddr = *loadaddr - N64_ROM_HEADER_SIZE;
 
     // disallow overwriting SA1, except do it properly
-    if ((void *)K1_TO_K0(adjusted_loadaddr) < &__sa1_end) {
+    if (((void *)K1_TO_K0(adjusted_loadaddr) < &__sa1_end) ||
+        (K1_TO_K0(adjusted_loadaddr) + N64_ROM_HEADER_SIZE > RAM_END)) {
+        close_sa2_stream();
         return 1;
     }
 
-    if (K1_TO_K0(adjusted_loadaddr + decompressed_size) >= RAM_END) {
+    // neither format says up front how big the output is, so a corrupt image is only stopped by this cap: no more than
+    // SA2_MAX_SIZE past the load address, and never past the end of RAM
+    max_size = MIN(SA2_MAX_SIZE, RAM_END - K1_TO_K0(adjusted_loadaddr));
+
+    // the stream still starts at the first block, so decompress it from the start, this time straight into place
+    // (only the few bytes of header above were decoded already); for gzip, the ISIZE trailer is checked as well
+    ret = decompress_payload(&sa2_stream, adjusted_loadaddr, max_size);
+    if ((ret >= 0) && (ret < N64_ROM_HEADER_SIZE)) {
+        ret = DECOMPRESS_ERR_DATA;
+    }
+    if (ret < 0) {
+        close_sa2_stream();
+        if (sa2_cancel) {
+            return 1;
+        }
+        sa2_error = SA2_ERROR_DECOMPRESS;
+        sa2_error_code = ret;
+
         return 1;
     }
 
-    bcopy(decompressed_buf, adjusted_loadaddr, decompressed_size);
+    trace_event(TRACE_SA2_DECOMPRESS, ret, sa2_next_read * BYTES_PER_BLOCK);
+
+    ret = verify_sa2_stream(cmd);
+    close_sa2_stream();
+    trace_event(TRACE_SA2_VERIFY, sa2_hash_cycles, ret);
+    if (sa2_cancel) {
+        return 1;
+    }
+    if (ret) {
+        sa2_error = SA2_ERROR_HASH;
+
+        return 1;
+    }
 
     return 0;
 }
@@ -205,7 +301,7 @@ s32 load_sa_ticket(u16 *sa_start_block, u16 start_block) {
     return ret;
 }
 
-s32 load_sa2(SA2Entry *loadaddr) {
+s32 find_sa2_blocks(u32 *num_blocks) {
     s32 ret;
     BbContentMetaDataHead *cmd;
     u16 sa1_start, sa2_start;
@@ -222,12 +318,17 @@ s32 load_sa2(SA2Entry *loadaddr) {
 
     sa2_cmd = sa1_start;
     for (u32 i = 0; i < sa1_num_blocks; i++) {
-        ret = read_page(sa2_cmd * PAGES_PER_BLOCK);
+        // only the link is needed here (with NAND_SPARE_READS, the page data is skipped)
+        ret = read_spare(sa2_cmd * PAGES_PER_BLOCK);
         if (ret) {
             return ret;
         }
 
         sa2_cmd = block_link(IO_READ(PI_10400_REG));
+
+        if (sa2_cancel) {
+            return 1;
+        }
     }
 
     ret = load_sa_ticket(&sa2_start, sa2_cmd);
@@ -242,14 +343,123 @@ s32 load_sa2(SA2Entry *loadaddr) {
 
     sa2_blocks[0] = sa2_start;
     for (u32 i = 0; i < sa2_num_blocks; i++) {
-        ret = read_page(sa2_blocks[i] * PAGES_PER_BLOCK);
+        ret = read_spare(sa2_blocks[i] * PAGES_PER_BLOCK);
         if (ret) {
             return ret;
         }
 
         sa2_blocks[i + 1] = block_link(IO_READ(PI_10400_REG));
+
+        if (sa2_cancel) {
+            return 1;
+        }
     }
     sa2_blocks[sa2_num_blocks] = 0;
 
-    return decompress_sa2(loadaddr, cmd, sa2_blocks, sa2_num_blocks);
-}
\ No newline at end of file
+    *num_blocks = sa2_num_blocks;
+
+    return 0;
+}
+
+s32 load_sa2(SA2Entry *loadaddr) {
+    s32 ret;
+    u32 num_blocks = 0;
+
+    trace_event(TRACE_SA2_START, 0, 0);
+
+    // sleep through the NAND accesses of the chain walk instead of spinning
+    claim_nand_interrupts();
+    ret = find_sa2_blocks(&num_blocks);
+    release_nand_interrupts();
+    trace_event(TRACE_SA2_CHAIN, num_blocks, ret);
+    if (ret || sa2_cancel) {
+        return 1;
+    }
+
+    ret = decompress_sa2(loadaddr, (BbContentMetaDataHead *)cmd_buf, sa2_blocks, num_blocks);
+    trace_event(TRACE_SA2_DONE, ret, sa2_cancel);
+
+    return ret;
+}
+
+void sa2proc(void *argv) {
+    s32 ret = load_sa2(&sa2_prefetch_addr);
+
+    osSendMesg(&sa2_done_queue, (OSMesg)ret, OS_MESG_BLOCK);
+
+    // let the thread die
+}
+
+void start_sa2_prefetch(void) {
+    if (sa2_prefetch_running) {
+        return;
+    }
+
+    sa2_cancel = FALSE;
+    sa2_prefetch_running = TRUE;
+    sa2_error = SA2_ERROR_NONE;
+
+    osCreateMesgQueue(&sa2_done_queue, sa2_done_buf, ARRLEN(sa2_done_buf));
+
+    // below the main and button threads, so the menu stays responsive
+    osCreateThread(&sa2_thread, 6, sa2proc, NULL, sa2_stack + sizeof(sa2_stack), 10);
+    osStartThread(&sa2_thread);
+}
+
+s32 finish_sa2_prefetch(SA2Entry *loadaddr) {
+    OSMesg ret;
+
+    if (!sa2_prefetch_running) {
+        return 1;
+    }
+
+    osRecvMesg(&sa2_done_queue, &ret, OS_MESG_BLOCK);
+    sa2_prefetch_running = FALSE;
+
+    if ((s32)ret != 0) {
+        return (s32)ret;
+    }
+
+    *loadaddr = sa2_prefetch_addr;
+
+    // only now that SA2 is definitely being launched can the globals it expects be set up
+    osWritebackDCacheAll();
+    // clear 64KiB of instruction cache for some reason????
+    osInvalICache((void *)K0BASE, 64 * 1024);
+
+    osRomBase = (void *)PHYS_TO_K1(PI_DOM1_ADDR2);
+    osMemSize = 4 * 1024 * 1024;
+    osTvType = OS_TV_NTSC;
+
+    return 0;
+}
+
+// shows why the last load failed, if it got as far as decompressing
+void print_sa2_error(void) {
+    switch (sa2_error) {
+        case SA2_ERROR_DECOMPRESS:
+            fbPrintf(fbRed, 3, 8, "Decompress error: %d", sa2_error_code);
+            break;
+
+        case SA2_ERROR_HASH:
+            fbPrintStr(fbRed, 3, 8, "SA2 hash mismatch");
+            break;
+
+        default:
+            return;
+    }
+
+    osWritebackDCacheAll();
+}
+
+// stops the loader and waits for it to let go of the NAND and its DMA buffers
+void cancel_sa2_prefetch(void) {
+    if (!sa2_prefetch_running) {
+        return;
+    }
+
+    sa2_cancel = TRUE;
+
+    osRecvMesg(&sa2_done_queue, NULL, OS_MESG_BLOCK);
+    sa2_prefetch_running = FALSE;
+}
@@ -7,4 +7,9 @@ typedef void (*SA2Entry)(u32);
 
 s32 load_sa2(SA2Entry *);
 
+void start_sa2_prefetch(void);
+s32 finish_sa2_prefetch(SA2Entry *);
+void cancel_sa2_prefetch(void);
+void print_sa2_error(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include <PR/ultratypes.h>
+#include <PR/os_libc.h>
+#include <sha1.h>
+
+/*
+ * SHA-1 behind the SDK's sha1.h interface, so everything that hashes (SA2 verification, mon) gets this one
+ *
+ * - all 80 rounds are unrolled, with the message schedule kept as a rolling 16-word window
+ * - word-aligned input is loaded straight out of the caller's buffer; only unaligned blocks and the tail of an
+ *   input go through the 64-byte buffer in the context
+ * - count_lo/count_hi hold the total input length in bytes
+ */
+
+#define SHA1_BLOCK_SIZE (64)
+
+// big-endian loads are free on the VR4300, anything else assembles the word a byte at a time
+#ifdef __MIPSEB__
+#define LOAD_WORD(p, i) (((u32 *)(p))[i])
+#else
+#define LOAD_WORD(p, i) (((u32)(p)[(i) * 4] << 24) | ((u32)(p)[(i) * 4 + 1] << 16) | ((u32)(p)[(i) * 4 + 2] << 8) | (p)[(i) * 4 + 3])
+#endif
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define F0(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F1(b, c, d) ((b) ^ (c) ^ (d))
+#define F2(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define F3(b, c, d) ((b) ^ (c) ^ (d))
+
+#define K0 (0x5A827999)
+#define K1 (0x6ED9EBA1)
+#define K2 (0x8F1BBCDC)
+#define K3 (0xCA62C1D6)
+
+#define W(i) (w[(i) & 15])
+#define EXPAND(i) (W(i) = ROL(W((i) + 13) ^ W((i) + 8) ^ W((i) + 2) ^ W(i), 1))
+
+#define ROUND_LOAD(a, b, c, d, e, i)                                                                                   \
+    e += ROL(a, 5) + F0(b, c, d) + K0 + (W(i) = LOAD_WORD(p, i));                                                      \
+    b = ROL(b, 30);
+#define ROUND(f, k, a, b, c, d, e, i)                                                                                  \
+    e += ROL(a, 5) + f(b, c, d) + k + EXPAND(i);                                                                       \
+    b = ROL(b, 30);
+
+#define ROUNDS_LOAD(i)                                                                                                 \
+    ROUND_LOAD(a, b, c, d, e, (i));                                                                                    \
+    ROUND_LOAD(e, a, b, c, d, (i) + 1);                                                                                \
+    ROUND_LOAD(d, e, a, b, c, (i) + 2);                                                                                \
+    ROUND_LOAD(c, d, e, a, b, (i) + 3);                                                                                \
+    ROUND_LOAD(b, c, d, e, a, (i) + 4);
+#define ROUNDS(f, k, i)                                                                                                \
+    ROUND(f, k, a, b, c, d, e, (i));                                                                                   \
+    ROUND(f, k, e, a, b, c, d, (i) + 1);                                                                               \
+    ROUND(f, k, d, e, a, b, c, (i) + 2);                                                                               \
+    ROUND(f, k, c, d, e, a, b, (i) + 3);                                                                               \
+    ROUND(f, k, b, c, d, e, a, (i) + 4);
+
+// p must be word-aligned
+static void sha1_block(u32 *digest, const u8 *p) {
+    u32 w[16];
+    u32 a = digest[0], b = digest[1], c = digest[2], d = digest[3], e = digest[4];
+
+    ROUNDS_LOAD(0);
+    ROUNDS_LOAD(5);
+    ROUNDS_LOAD(10);
+    ROUND_LOAD(a, b, c, d, e, 15);
+
+    ROUND(F0, K0, e, a, b, c, d, 16);
+    ROUND(F0, K0, d, e, a, b, c, 17);
+    ROUND(F0, K0, c, d, e, a, b, 18);
+    ROUND(F0, K0, b, c, d, e, a, 19);
+
+    ROUNDS(F1, K1, 20);
+    ROUNDS(F1, K1, 25);
+    ROUNDS(F1, K1, 30);
+    ROUNDS(F1, K1, 35);
+
+    ROUNDS(F2, K2, 40);
+    ROUNDS(F2, K2, 45);
+    ROUNDS(F2, K2, 50);
+    ROUNDS(F2, K2, 55);
+
+    ROUNDS(F3, K3, 60);
+    ROUNDS(F3, K3, 65);
+    ROUNDS(F3, K3, 70);
+    ROUNDS(F3, K3, 75);
+
+    digest[0] += a;
+    digest[1] += b;
+    digest[2] += c;
+    digest[3] += d;
+    digest[4] += e;
+}
+
+int SHA1Reset(SHA1Context *ctx) {
+    ctx->digest[0] = 0x67452301;
+    ctx->digest[1] = 0xEFCDAB89;
+    ctx->digest[2] = 0x98BADCFE;
+    ctx->digest[3] = 0x10325476;
+    ctx->digest[4] = 0xC3D2E1F0;
+    ctx->count_lo = 0;
+    ctx->count_hi = 0;
+
+    return 0;
+}
+
+int SHA1Input(SHA1Context *ctx, u8 *buffer, int count) {
+    u8 *data = (u8 *)ctx->data;
+    u32 used;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    used = ctx->count_lo % SHA1_BLOCK_SIZE;
+    ctx->count_lo = ctx->count_lo + count;
+    if (ctx->count_lo < (u32)count) {
+        ctx->count_hi++;
+    }
+
+    // top up a partial block first
+    if (used != 0) {
+        u32 fill = SHA1_BLOCK_SIZE - used;
+
+        if ((u32)count < fill) {
+            bcopy(buffer, data + used, count);
+            return 0;
+        }
+
+        bcopy(buffer, data + used, fill);
+        sha1_block(ctx->digest, data);
+        buffer += fill;
+        count -= fill;
+    }
+
+    if (((u32)buffer & 3) == 0) {
+        while (count >= SHA1_BLOCK_SIZE) {
+            sha1_block(ctx->digest, buffer);
+            buffer += SHA1_BLOCK_SIZE;
+            count -= SHA1_BLOCK_SIZE;
+        }
+    } else {
+        while (count >= SHA1_BLOCK_SIZE) {
+            bcopy(buffer, data, SHA1_BLOCK_SIZE);
+            sha1_block(ctx->digest, data);
+            buffer += SHA1_BLOCK_SIZE;
+            count -= SHA1_BLOCK_SIZE;
+        }
+    }
+
+    if (count > 0) {
+        bcopy(buffer, data, count);
+    }
+
+    return 0;
+}
+
+int SHA1Result(SHA1Context *ctx, u8 *digest) {
+    u8 *data = (u8 *)ctx->data;
+    u32 used = ctx->count_lo % SHA1_BLOCK_SIZE;
+    // the length goes in the last 8 bytes, in bits
+    u32 bits_hi = (ctx->count_hi << 3) | (ctx->count_lo >> 29);
+    u32 bits_lo = ctx->count_lo << 3;
+
+    data[used++] = 0x80;
+    if (used > SHA1_BLOCK_SIZE - 8) {
+        bzero(data + used, SHA1_BLOCK_SIZE - used);
+        sha1_block(ctx->digest, data);
+        used = 0;
+    }
+    bzero(data + used, SHA1_BLOCK_SIZE - 8 - used);
+
+    for (u32 i = 0; i < 4; i++) {
+        data[SHA1_BLOCK_SIZE - 8 + i] = bits_hi >> (24 - i * 8);
+        data[SHA1_BLOCK_SIZE - 4 + i] = bits_lo >> (24 - i * 8);
+    }
+    sha1_block(ctx->digest, data);
+
+    for (u32 i = 0; i < 5; i++) {
+        digest[i * 4] = ctx->digest[i] >> 24;
+        digest[i * 4 + 1] = ctx->digest[i] >> 16;
+        digest[i * 4 + 2] = ctx->digest[i] >> 8;
+        digest[i * 4 + 3] = ctx->digest[i];
+    }
+
+    return 0;
+}
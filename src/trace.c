@@ -0,0 +1,76 @@
+#include <PR/os_internal.h>
+#include <libfb.h>
+#include <macros.h>
+#include <ultra64.h>
+
+#include "trace.h"
+
+static const char *event_names[] = {
+    [TRACE_BOOT] = "boot",
+    [TRACE_SETUP_VI] = "setup_vi",
+    [TRACE_OS_INIT] = "os init",
+    [TRACE_CONTROLLER_INIT] = "controllers",
+    [TRACE_MENU_CHOICE] = "menu",
+    [TRACE_SA2_START] = "sa2 start",
+    [TRACE_SA2_CHAIN] = "sa2 chain",
+    [TRACE_SA2_DECOMPRESS] = "sa2 inflate",
+    [TRACE_SA2_VERIFY] = "sa2 verify",
+    [TRACE_SA2_DONE] = "sa2 done",
+    [TRACE_NAND_ERROR] = "nand error",
+    [TRACE_LAUNCH] = "launch",
+};
+
+void trace_init(u32 entry_type) {
+    TraceHeader *header = &trace_buffer->header;
+
+    // a warm boot keeps what the previous boot recorded, as long as it's intact
+    if (((entry_type & 0x4C) == 0) || (header->magic != TRACE_MAGIC)) {
+        header->magic = TRACE_MAGIC;
+        header->next = 0;
+    }
+    header->count_rate = OS_CPU_COUNTER;
+
+    trace_event(TRACE_BOOT, entry_type, 0);
+}
+
+// the uncached buffer needs no cache maintenance, so this is safe from any thread at any point
+void trace_event(u32 event, u32 arg0, u32 arg1) {
+    TraceEntry *entry;
+    u32 saved_mask = __osDisableInt();
+
+    entry = &trace_buffer->entries[trace_buffer->header.next++ % TRACE_ENTRIES];
+    entry->time = osGetCount();
+    entry->event = event;
+    entry->arg0 = arg0;
+    entry->arg1 = arg1;
+
+    __osRestoreInt(saved_mask);
+}
+
+// shows the current boot's events, with times in ms since it started
+void print_trace(void) {
+    TraceHeader *header = &trace_buffer->header;
+    u32 first = header->next - 1;
+    u32 oldest = (header->next > TRACE_ENTRIES) ? (header->next - TRACE_ENTRIES) : 0;
+    u32 start_time;
+    u32 row = 1;
+
+    // the most recent boot event is where this boot starts
+    while ((first > oldest) && (trace_buffer->entries[first % TRACE_ENTRIES].event != TRACE_BOOT)) {
+        first--;
+    }
+    start_time = trace_buffer->entries[first % TRACE_ENTRIES].time;
+
+    fbClear();
+
+    for (u32 i = first; (i < header->next) && (row < FB_TEXT_HT - 1); i++, row++) {
+        TraceEntry *entry = &trace_buffer->entries[i % TRACE_ENTRIES];
+        u32 us = OS_CYCLES_TO_USEC(entry->time - start_time);
+        const char *name = (entry->event < ARRLEN(event_names)) ? event_names[entry->event] : NULL;
+
+        fbPrintf(FB_WHITE, 1, row, "%-11s %5d.%03d %x %x", (name != NULL) ? name : "?", us / 1000, us % 1000,
+                 entry->arg0, entry->arg1);
+    }
+
+    osWritebackDCacheAll();
+}
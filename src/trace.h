@@ -0,0 +1,56 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <sa1.h>
+#include <ultra64.h>
+
+// lives at TRACE_PHYS_ADDR, out of the way of SA2, so it survives launching it and warm resets; an app may reuse the
+// page, and trace_init only starts over if that clobbered the magic
+
+#define TRACE_MAGIC (0x54524345) // "TRCE"
+
+typedef enum {
+    TRACE_BOOT = 1,
+    TRACE_SETUP_VI,
+    TRACE_OS_INIT,
+    TRACE_CONTROLLER_INIT,
+    TRACE_MENU_CHOICE,
+    TRACE_SA2_START,
+    TRACE_SA2_CHAIN,
+    TRACE_SA2_DECOMPRESS,
+    TRACE_SA2_VERIFY,
+    TRACE_SA2_DONE,
+    TRACE_NAND_ERROR,
+    TRACE_LAUNCH,
+} TraceEvent;
+
+typedef struct {
+    u32 time;
+    u32 event;
+    u32 arg0;
+    u32 arg1;
+} TraceEntry;
+
+typedef struct {
+    u32 magic;
+    // osGetCount ticks per second
+    u32 count_rate;
+    // total number of entries ever written, the next one goes at next % TRACE_ENTRIES
+    u32 next;
+    u32 pad;
+} TraceHeader;
+
+#define TRACE_ENTRIES ((TRACE_SIZE - sizeof(TraceHeader)) / sizeof(TraceEntry))
+
+typedef struct {
+    TraceHeader header;
+    TraceEntry entries[TRACE_ENTRIES];
+} TraceBuffer;
+
+#define trace_buffer ((TraceBuffer *)PHYS_TO_K1(TRACE_PHYS_ADDR))
+
+void trace_init(u32 entry_type);
+void trace_event(u32 event, u32 arg0, u32 arg1);
+void print_trace(void);
+
+#endif
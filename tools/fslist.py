@@ -0,0 +1,66 @@
+#
+#   Decode the reply to mon's CMD_FS_LIST (0x4C) into a directory listing
+#
+#   The reply (after the usual two words, the second being the file count) is big-endian: the osBbFStatFs totals
+#   (files, blocks, free files, free blocks as u16s) followed by a 20 byte entry per file (name[8], ext[3], type,
+#   size, block count, first block)
+#
+
+import argparse, struct, sys
+
+BYTES_PER_BLOCK = 16 * 1024
+
+STATFS_SIZE = 8
+ENTRY_SIZE = 20
+
+
+def fs_name(name, ext):
+    name = name.rstrip(b'\0').decode('ascii', 'replace')
+    ext = ext.rstrip(b'\0').decode('ascii', 'replace')
+    return f'{name}.{ext}' if ext else name
+
+
+def parse(data):
+    files, blocks, free_files, free_blocks = struct.unpack_from('>4H', data)
+
+    entries = []
+    for offset in range(STATFS_SIZE, len(data) - ENTRY_SIZE + 1, ENTRY_SIZE):
+        name, ext, kind, size, count, first = struct.unpack_from('>8s3sBIHH', data, offset)
+        entries.append((fs_name(name, ext), kind, size, count, first))
+
+    return (files, blocks, free_files, free_blocks), entries
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a mon filesystem listing')
+    parser.add_argument('input', help='CMD_FS_LIST reply, without the leading two words')
+    parser.add_argument('-s', '--sort', choices=('name', 'size', 'block'), help='sort the listing')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+
+    if len(data) < STATFS_SIZE:
+        print(f'Error: expected at least {STATFS_SIZE} bytes, got {len(data)}')
+        sys.exit(1)
+
+    (files, blocks, free_files, free_blocks), entries = parse(data)
+
+    if args.sort == 'name':
+        entries.sort(key=lambda e: e[0])
+    elif args.sort == 'size':
+        entries.sort(key=lambda e: e[2])
+    elif args.sort == 'block':
+        entries.sort(key=lambda e: e[4])
+
+    print(f'{"name":<14}{"type":>6}{"size":>12}{"blocks":>8}{"first":>8}')
+    for name, kind, size, count, first in entries:
+        print(f'{name:<14}{kind:>6}{size:>12}{count:>8}{first:>8X}')
+
+    print()
+    print(f'{len(entries)} files listed, {files - free_files} of {files} file slots used')
+    print(f'{blocks - free_blocks} of {blocks} blocks used, {free_blocks * BYTES_PER_BLOCK // 1024} KiB free')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,126 @@
+//
+//  Host check and benchmark for src/checksum.c
+//
+//  checksumbench       checks update_checksum against adding the bytes one at a time, for random lengths, alignments,
+//                      starting values and splits of the input
+//  checksumbench -b    compares the MB/s of the two over NAND block sized chunks, like checksum_file hands it
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <PR/ultratypes.h>
+#include <macros.h>
+
+#include "blocks.h"
+#include "checksum.h"
+
+#define BENCH_SIZE (64 << 20)
+
+static uint32_t byte_checksum(u8 *data, u32 size, uint32_t checksum) {
+    while (size--) {
+        checksum += *data++;
+    }
+
+    return checksum;
+}
+
+static s32 run_checks(u32 count) {
+    u8 *buf = malloc(3 * BYTES_PER_BLOCK + 8);
+    s32 failures = 0;
+
+    for (u32 n = 0; n < count; n++) {
+        u32 size = (n < 2100) ? n : (rand() % (3 * BYTES_PER_BLOCK));
+        u32 offset = n % 8;
+        uint32_t start = (n % 4 == 0) ? 0 : (uint32_t)rand() * 0x10001;
+        u8 *data = buf + offset;
+        uint32_t expected, got = start;
+        u32 pos = 0;
+
+        // all 0xFF now and then, for the lanes' worst case
+        for (u32 i = 0; i < size; i++) {
+            data[i] = (n % 16 == 0) ? 0xFF : rand();
+        }
+
+        expected = byte_checksum(data, size, start);
+        while (pos < size) {
+            u32 chunk = (n % 2) ? size : (1 + rand() % 2000);
+
+            chunk = MIN(chunk, size - pos);
+
+            got = update_checksum(data + pos, chunk, got);
+            pos += chunk;
+        }
+
+        if (got != expected) {
+            printf("  FAIL %u bytes at offset %u: got %08X, expected %08X\n", size, offset, got, expected);
+            failures++;
+        }
+    }
+
+    free(buf);
+    return failures;
+}
+
+static double mb_per_s(u8 *data, s32 reference, uint32_t *checksum) {
+    struct timespec start, end;
+    double secs, best = 0;
+
+    // best of a few runs, so the first one warming things up doesn't count against it
+    for (u32 i = 0; i < 3; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        *checksum = 0;
+        for (u32 pos = 0; pos < BENCH_SIZE; pos += BYTES_PER_BLOCK) {
+            if (reference) {
+                *checksum = byte_checksum(data + pos, BYTES_PER_BLOCK, *checksum);
+            } else {
+                *checksum = update_checksum(data + pos, BYTES_PER_BLOCK, *checksum);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best = MAX(best, BENCH_SIZE / secs / 1e6);
+    }
+
+    return best;
+}
+
+static s32 bench(void) {
+    u8 *buf = malloc(BENCH_SIZE);
+    uint32_t checksum, ref_checksum;
+    double speed, ref_speed;
+
+    for (u32 i = 0; i < BENCH_SIZE; i++) {
+        buf[i] = rand();
+    }
+
+    speed = mb_per_s(buf, FALSE, &checksum);
+    ref_speed = mb_per_s(buf, TRUE, &ref_checksum);
+    printf("%d MiB: update_checksum %.1f MB/s, byte loop %.1f MB/s (%.2fx)%s\n", BENCH_SIZE >> 20, speed, ref_speed,
+           speed / ref_speed, (checksum == ref_checksum) ? "" : ", CHECKSUMS DIFFER");
+
+    free(buf);
+    return checksum != ref_checksum;
+}
+
+int main(int argc, char **argv) {
+    s32 failures;
+
+    srand(1);
+
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        return bench();
+    }
+
+    failures = run_checks(5000);
+    if (failures) {
+        printf("%d checks failed\n", (int)failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
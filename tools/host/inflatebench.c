@@ -0,0 +1,294 @@
+//
+//  Host benchmark and fuzzer for src/inflate.c
+//
+//  inflatebench file.gz...     decompresses each file with inflate_gzip and with zlib, checks they agree and prints
+//                              the MB/s of each
+//  inflatebench -f [n [seed]]  round trips n made up inputs through zlib's deflate and back through inflate_gzip,
+//                              then feeds it corrupted and truncated copies; run the sanitized build (inflatefuzz)
+//                              to catch it reading or writing out of bounds
+//
+//  Input is handed over a NAND block at a time, the same as when SA2 is streamed off the card
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <PR/ultratypes.h>
+#include <macros.h>
+
+#include "blocks.h"
+#include "decompress.h"
+
+#define BENCH_MIN_NS (500000000)
+
+typedef struct {
+    InStream in;
+    u8 *data;
+    u32 size;
+    u32 pos;
+    u32 chunk;
+} BufStream;
+
+static s32 buf_refill(InStream *in) {
+    BufStream *s = (BufStream *)in;
+    u32 n = MIN(s->size - s->pos, s->chunk);
+
+    if (n == 0) {
+        return 1;
+    }
+
+    in->next = s->data + s->pos;
+    in->end = in->next + n;
+    s->pos += n;
+    return 0;
+}
+
+static s32 run_inflate(u8 *data, u32 size, u32 chunk, u8 *out, u32 out_size) {
+    BufStream s = { { NULL, NULL, buf_refill }, data, size, 0, chunk };
+
+    return inflate_gzip(&s.in, out, out_size);
+}
+
+static s32 run_zlib(u8 *data, u32 size, u8 *out, u32 out_size) {
+    z_stream z = { 0 };
+    s32 ret;
+
+    // 16 + MAX_WBITS: expect a gzip header
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+    z.next_in = data;
+    z.avail_in = size;
+    z.next_out = out;
+    z.avail_out = out_size;
+
+    ret = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+
+    return (ret == Z_STREAM_END) ? (s32)z.total_out : -1;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u8 *read_file(const char *path, u32 *size) {
+    FILE *f = fopen(path, "rb");
+    u8 *data;
+
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(*size);
+    if (fread(data, 1, *size, f) != *size) {
+        perror(path);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(f);
+    return data;
+}
+
+// the gzip trailer's ISIZE, which is enough for files under 4GiB
+static u32 gzip_isize(u8 *data, u32 size) {
+    u8 *p = data + size - 4;
+
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static s32 bench_file(const char *path) {
+    u32 size, out_size;
+    u8 *data = read_file(path, &size);
+    u8 *out, *ref;
+    s32 ret, ref_ret;
+    u64 start, ns_inflate, ns_zlib;
+    u32 iters;
+
+    if (data == NULL) {
+        return -1;
+    }
+    if (size < 18) {
+        printf("%s: too small to be a gzip file\n", path);
+        free(data);
+        return -1;
+    }
+
+    out_size = gzip_isize(data, size);
+    out = malloc(out_size + 1);
+    ref = malloc(out_size + 1);
+
+    ret = run_inflate(data, size, BYTES_PER_BLOCK, out, out_size);
+    ref_ret = run_zlib(data, size, ref, out_size);
+    if ((ret != ref_ret) || ((ret > 0) && (memcmp(out, ref, ret) != 0))) {
+        printf("%s: inflate_gzip returned %ld, zlib %ld, or the output differs\n", path, (long)ret, (long)ref_ret);
+        free(data);
+        free(out);
+        free(ref);
+        return -1;
+    }
+
+    // run each for at least BENCH_MIN_NS so small files still give a stable figure
+    start = now_ns();
+    for (iters = 0; (iters == 0) || ((now_ns() - start) < BENCH_MIN_NS); iters++) {
+        run_inflate(data, size, BYTES_PER_BLOCK, out, out_size);
+    }
+    ns_inflate = (now_ns() - start) / iters;
+
+    start = now_ns();
+    for (iters = 0; (iters == 0) || ((now_ns() - start) < BENCH_MIN_NS); iters++) {
+        run_zlib(data, size, ref, out_size);
+    }
+    ns_zlib = (now_ns() - start) / iters;
+
+    printf("%s: %u -> %u bytes, inflate_gzip %.1f MB/s, zlib %.1f MB/s (%.2fx)\n", path, size, out_size,
+           (out_size * 1000.0) / ns_inflate, (out_size * 1000.0) / ns_zlib, (double)ns_zlib / ns_inflate);
+
+    free(data);
+    free(out);
+    free(ref);
+    return 0;
+}
+
+// something compressible: runs, repeated phrases and a bit of noise, in proportions picked by the seed
+static void make_input(u8 *buf, u32 size) {
+    static const char *words[] = { "osBbCard", "ReadBlock", " = ", "0x", "FFFF", "\n    ", "return ", "sa2" };
+    u32 noise = rand() % 4;
+    u32 i = 0;
+
+    while (i < size) {
+        u32 kind = rand() % 8;
+
+        if (kind < noise) {
+            buf[i++] = rand();
+        } else if (kind < 5) {
+            const char *w = words[rand() % ARRLEN(words)];
+
+            while (*w && (i < size)) {
+                buf[i++] = *w++;
+            }
+        } else {
+            u32 run = rand() % 300;
+            u8 c = rand();
+
+            while (run-- && (i < size)) {
+                buf[i++] = c;
+            }
+        }
+    }
+}
+
+static u32 make_gzip(u8 *src, u32 size, u8 *dst, u32 dst_size) {
+    z_stream z = { 0 };
+    s32 strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED };
+    u32 ret;
+
+    deflateInit2(&z, rand() % 10, Z_DEFLATED, 16 + MAX_WBITS, 8, strategies[rand() % ARRLEN(strategies)]);
+    z.next_in = src;
+    z.avail_in = size;
+    z.next_out = dst;
+    z.avail_out = dst_size;
+    deflate(&z, Z_FINISH);
+    ret = z.total_out;
+    deflateEnd(&z);
+
+    return ret;
+}
+
+static s32 fuzz(u32 count) {
+    s32 failures = 0;
+
+    for (u32 n = 0; n < count; n++) {
+        u32 size = rand() % 70000;
+        u32 gz_max = size + (size / 8) + 1024;
+        u8 *src = malloc(size);
+        u8 *gz = malloc(gz_max);
+        u32 gz_size, chunk, out_size;
+        u8 *data, *out;
+        s32 ret;
+
+        make_input(src, size);
+        gz_size = make_gzip(src, size, gz, gz_max);
+        chunk = (rand() % 2) ? BYTES_PER_BLOCK : (1 + rand() % 64);
+
+        // exactly sized buffers, so the sanitizers catch any access past either end
+        data = malloc(gz_size);
+        memcpy(data, gz, gz_size);
+        out = malloc(size);
+        ret = run_inflate(data, gz_size, chunk, out, size);
+        if ((ret != (s32)size) || (memcmp(out, src, size) != 0)) {
+            printf("round trip %u: %u bytes, chunk %u, returned %ld\n", n, size, chunk, (long)ret);
+            failures++;
+        }
+        free(out);
+
+        // a short output buffer has to stop at the end of it
+        if (size > 0) {
+            out_size = rand() % size;
+            out = malloc(out_size);
+            ret = run_inflate(data, gz_size, chunk, out, out_size);
+            if ((ret != DECOMPRESS_ERR_OUTPUT) || (memcmp(out, src, out_size) != 0)) {
+                printf("short output %u: %u of %u bytes, returned %ld\n", n, out_size, size, (long)ret);
+                failures++;
+            }
+            free(out);
+        }
+
+        // then corrupt or truncate it; anything goes as long as it stays in bounds and owns up to what it wrote
+        for (u32 flips = 1 + rand() % 8; flips > 0; flips--) {
+            data[rand() % gz_size] ^= 1 << (rand() % 8);
+        }
+        if (rand() % 4 == 0) {
+            gz_size = rand() % gz_size;
+        }
+        out_size = size + (rand() % 256);
+        out = malloc(out_size);
+        ret = run_inflate(data, gz_size, chunk, out, out_size);
+        if (ret > (s32)out_size) {
+            printf("corrupt %u: returned %ld for a %u byte buffer\n", n, (long)ret, out_size);
+            failures++;
+        }
+        free(out);
+
+        free(data);
+        free(gz);
+        free(src);
+    }
+
+    printf("%u inputs fuzzed, %ld failures\n", count, (long)failures);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    s32 failures = 0;
+
+    if (argc < 2) {
+        printf("usage: %s file.gz... | -f [count [seed]]\n", argv[0]);
+        return 1;
+    }
+
+    if ((argv[1][0] == '-') && (argv[1][1] == 'f')) {
+        srand((argc > 3) ? strtoul(argv[3], NULL, 0) : 1);
+        return fuzz((argc > 2) ? strtoul(argv[2], NULL, 0) : 1000) != 0;
+    }
+
+    for (s32 i = 1; i < argc; i++) {
+        if (bench_file(argv[i]) != 0) {
+            failures++;
+        }
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,218 @@
+//
+//  Host fuzzer and benchmark for the raw block functions in src/lz4.c
+//
+//  lz4bench -f [n [seed]]  round trips n made up blocks through lz4_compress_block and lz4_decompress_block, into
+//                          exactly sized and short output buffers, then feeds it truncated and corrupted copies; run
+//                          the sanitized build (lz4fuzz) to catch it reading or writing out of bounds
+//  lz4bench -b [MiB]       prints the MB/s of each, a NAND block at a time, the same as mon's USB payloads
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <PR/ultratypes.h>
+#include <macros.h>
+
+#include "blocks.h"
+#include "decompress.h"
+
+// a compressed block can't grow past this, so the compressor never runs out of room
+#define LZ4_BOUND(size) ((size) + ((size) / 255) + 16)
+
+// something compressible: runs and short repeating patterns (for overlapping matches), repeated phrases and a bit of
+// noise, in proportions picked by the seed
+static void make_input(u8 *buf, u32 size) {
+    static const char *words[] = { "osBbCard", "ReadBlock", " = ", "0x", "FFFF", "\n    ", "return ", "sa2" };
+    u32 noise = rand() % 4;
+    u32 i = 0;
+
+    while (i < size) {
+        u32 kind = rand() % 8;
+
+        if (kind < noise) {
+            buf[i++] = rand();
+        } else if (kind < 5) {
+            const char *w = words[rand() % ARRLEN(words)];
+
+            while (*w && (i < size)) {
+                buf[i++] = *w++;
+            }
+        } else {
+            u32 period = 1 + rand() % 7;
+            u32 run = period + rand() % 600;
+
+            for (u32 j = 0; (j < run) && (i < size); j++, i++) {
+                buf[i] = (j < period) ? rand() : buf[i - period];
+            }
+        }
+    }
+}
+
+// copies into an exactly sized buffer, so the sanitizers catch any access past either end
+static u8 *exact_copy(u8 *data, u32 size) {
+    u8 *copy = malloc(size);
+
+    memcpy(copy, data, size);
+    return copy;
+}
+
+static s32 fuzz(u32 count) {
+    s32 failures = 0;
+
+    for (u32 n = 0; n < count; n++) {
+        u32 size = (n < 100) ? n : (rand() % 0x10000);
+        u32 packed_max = LZ4_BOUND(size);
+        u8 *src = malloc(size);
+        u8 *packed = malloc(packed_max);
+        u32 packed_size, out_size, cut;
+        u8 *data, *out;
+        s32 ret;
+
+        make_input(src, size);
+        packed_size = lz4_compress_block(src, size, packed, packed_max);
+        if (packed_size == 0) {
+            printf("compress %u: %u bytes didn't fit in %u\n", n, size, packed_max);
+            failures++;
+            free(packed);
+            free(src);
+            continue;
+        }
+
+        // a destination that's too small has to be turned down without writing past it
+        if (packed_size > 1) {
+            out_size = rand() % packed_size;
+            out = malloc(out_size);
+            ret = lz4_compress_block(src, size, out, out_size);
+            if (ret != 0) {
+                printf("compress %u: %u bytes into %u of the %u needed returned %d\n", n, size, out_size, packed_size, (int)ret);
+                failures++;
+            }
+            free(out);
+        }
+
+        data = exact_copy(packed, packed_size);
+        out = malloc(size);
+        ret = lz4_decompress_block(data, packed_size, out, size);
+        if ((ret != (s32)size) || (memcmp(out, src, size) != 0)) {
+            printf("round trip %u: %u bytes from %u, returned %d\n", n, size, packed_size, (int)ret);
+            failures++;
+        }
+        free(out);
+
+        // a short output buffer has to stop at the end of it
+        if (size > 0) {
+            out_size = rand() % size;
+            out = malloc(out_size);
+            ret = lz4_decompress_block(data, packed_size, out, out_size);
+            if ((ret != DECOMPRESS_ERR_OUTPUT) || (memcmp(out, src, out_size) != 0)) {
+                printf("short output %u: %u of %u bytes, returned %d\n", n, out_size, size, (int)ret);
+                failures++;
+            }
+            free(out);
+        }
+
+        // a truncated block can end cleanly after some literals, but anything it does give back has to be right
+        cut = rand() % packed_size;
+        free(data);
+        data = exact_copy(packed, cut);
+        out = malloc(size);
+        ret = lz4_decompress_block(data, cut, out, size);
+        if ((ret > (s32)size) || ((ret >= 0) && (memcmp(out, src, ret) != 0))) {
+            printf("truncated %u: %u of %u bytes, returned %d\n", n, cut, packed_size, (int)ret);
+            failures++;
+        }
+        free(out);
+
+        // then corrupt it; anything goes as long as it stays in bounds and owns up to what it wrote
+        free(data);
+        data = exact_copy(packed, packed_size);
+        for (u32 flips = 1 + rand() % 8; flips > 0; flips--) {
+            data[rand() % packed_size] ^= 1 << (rand() % 8);
+        }
+        out_size = size + (rand() % 256);
+        out = malloc(out_size);
+        ret = lz4_decompress_block(data, packed_size, out, out_size);
+        if (ret > (s32)out_size) {
+            printf("corrupt %u: returned %d for a %u byte buffer\n", n, (int)ret, out_size);
+            failures++;
+        }
+        free(out);
+
+        free(data);
+        free(packed);
+        free(src);
+    }
+
+    printf("%u blocks fuzzed, %d failures\n", count, (int)failures);
+    return failures;
+}
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// best of a few runs, so the first one warming things up doesn't count against it
+static s32 bench(u32 mib) {
+    u32 num_blocks = (mib << 20) / BYTES_PER_BLOCK;
+    u8 *src = malloc(num_blocks * BYTES_PER_BLOCK);
+    u8 *packed = malloc(num_blocks * LZ4_BOUND(BYTES_PER_BLOCK));
+    u32 *packed_sizes = malloc(num_blocks * sizeof(u32));
+    u8 *out = malloc(BYTES_PER_BLOCK);
+    double compress = 0, decompress = 0;
+    u64 total = 0;
+
+    for (u32 i = 0; i < num_blocks; i++) {
+        make_input(src + i * BYTES_PER_BLOCK, BYTES_PER_BLOCK);
+    }
+
+    for (u32 run = 0; run < 3; run++) {
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        total = 0;
+        for (u32 i = 0; i < num_blocks; i++) {
+            packed_sizes[i] = lz4_compress_block(src + i * BYTES_PER_BLOCK, BYTES_PER_BLOCK, packed + i * LZ4_BOUND(BYTES_PER_BLOCK),
+                                                 LZ4_BOUND(BYTES_PER_BLOCK));
+            total += packed_sizes[i];
+        }
+        compress = MAX(compress, num_blocks * BYTES_PER_BLOCK / elapsed(&start) / 1e6);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (u32 i = 0; i < num_blocks; i++) {
+            if (lz4_decompress_block(packed + i * LZ4_BOUND(BYTES_PER_BLOCK), packed_sizes[i], out, BYTES_PER_BLOCK) != BYTES_PER_BLOCK) {
+                printf("block %u didn't round trip\n", i);
+                return 1;
+            }
+        }
+        decompress = MAX(decompress, num_blocks * BYTES_PER_BLOCK / elapsed(&start) / 1e6);
+    }
+
+    printf("%u blocks, %.1f%% of the size: compress %.1f MB/s, decompress %.1f MB/s\n", num_blocks,
+           total * 100.0 / ((u64)num_blocks * BYTES_PER_BLOCK), compress, decompress);
+
+    free(out);
+    free(packed_sizes);
+    free(packed);
+    free(src);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if ((argc < 2) || (argv[1][0] != '-') || ((argv[1][1] != 'f') && (argv[1][1] != 'b'))) {
+        printf("usage: %s -f [count [seed]] | -b [MiB]\n", argv[0]);
+        return 1;
+    }
+
+    if (argv[1][1] == 'b') {
+        srand(1);
+        return bench((argc > 2) ? strtoul(argv[2], NULL, 0) : 64);
+    }
+
+    srand((argc > 3) ? strtoul(argv[3], NULL, 0) : 1);
+    return fuzz((argc > 2) ? strtoul(argv[2], NULL, 0) : 1000) != 0;
+}
@@ -0,0 +1,470 @@
+//
+//  Host stand-in for src/nand.c
+//
+//  nand.c is built as-is against a simulated PI/MI register file and a single-threaded stand-in for the message
+//  queue calls it makes, then driven through the poll path, the interrupt path and the card being pulled mid-read
+//
+//  nandsim [spare.bin [start block [blocks]]] also walks a block chain (like find_sa2_blocks does) with full page reads and
+//  with spare-only reads, and compares the time each takes under a simple NAND timing model. spare.bin is the spare
+//  area dump that goes with a NAND image, 16 bytes per block or per page; without one, a made up chain is used
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ultra64.h>
+#include <bbtypes.h>
+
+#include "blocks.h"
+
+// the register accesses in nand.c go to the simulated registers instead
+#undef IO_READ
+#undef IO_WRITE
+#define IO_READ(addr) sim_read(addr)
+#define IO_WRITE(addr, data) sim_write(addr, (u32)(data))
+
+static u32 sim_read(u32 addr);
+static void sim_write(u32 addr, u32 data);
+
+#include "../../src/nand.c"
+
+#define SIM_BLOCKS (64)
+#define SPARE_SIZE (16)
+
+#define PI_48_BUSY (0x80000000)
+#define PI_48_ECC (0x00000400)
+#define MI_38_CARD_PULLED (0x02000000)
+
+// how many PI_48_REG reads a command stays busy for
+#define SIM_BUSY_POLLS (3)
+
+// timing model, from typical 64MiB small page NAND datasheets: the array to page register load (tR) and the serial
+// transfer out of it (tRC per byte), plus the CPU clock the time is converted to cycles at
+#define NAND_TR_NS (12000)
+#define NAND_TRC_NS (50)
+#define CPU_MHZ (144)
+
+typedef struct {
+    u8 (*spare)[SPARE_SIZE];
+    u8 *ecc_error;
+    u32 pages;
+
+    u32 page_addr;
+    u32 spare_regs[2];
+    s32 busy;
+    s32 ecc;
+    s32 card_pulled;
+    // pull the card when the next command is started, before it completes
+    s32 pull_on_next_cmd;
+
+    u32 commands;
+    u32 page_reads;
+    u32 spare_reads;
+    u32 aborts;
+    u32 polls;
+    u64 busy_ns;
+} NandSim;
+
+static NandSim sim;
+
+static u32 be32(u8 *p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+// events, as registered through osSetEventMesg (the iQue ones go past OS_NUM_EVENTS)
+#define SIM_EVENTS (32)
+
+static OSMesgQueue *event_queue[SIM_EVENTS];
+static OSMesg event_mesg[SIM_EVENTS];
+
+void osCreateMesgQueue(OSMesgQueue *mq, OSMesg *msg, s32 count) {
+    bzero(mq, sizeof(*mq));
+    mq->msg = msg;
+    mq->msgCount = count;
+}
+
+void osSetEventMesg(OSEvent event, OSMesgQueue *mq, OSMesg msg) {
+    event_queue[event] = mq;
+    event_mesg[event] = msg;
+}
+
+static s32 sim_send(OSMesgQueue *mq, OSMesg msg) {
+    if (mq->validCount >= mq->msgCount) {
+        return -1;
+    }
+    mq->msg[(mq->first + mq->validCount) % mq->msgCount] = msg;
+    mq->validCount++;
+    return 0;
+}
+
+static void sim_raise(OSEvent event) {
+    if (event_queue[event] != NULL) {
+        sim_send(event_queue[event], event_mesg[event]);
+    }
+}
+
+s32 osRecvMesg(OSMesgQueue *mq, OSMesg *msg, s32 flag) {
+    if (mq->validCount == 0) {
+        if (flag == OS_MESG_NOBLOCK) {
+            return -1;
+        }
+        // nothing else runs here, so blocking on an empty queue would never return on hardware either
+        fprintf(stderr, "osRecvMesg would block forever\n");
+        exit(1);
+    }
+    if (msg != NULL) {
+        *msg = mq->msg[mq->first];
+    }
+    mq->first = (mq->first + 1) % mq->msgCount;
+    mq->validCount--;
+    return 0;
+}
+
+// stands in for the card driver's own queue, which the SDK's card init registers
+static OSMesgQueue card_mesg_queue;
+static u32 card_inits;
+
+void osBbCardInit(void) {
+    osSetEventMesg(OS_EVENT_FLASH, &card_mesg_queue, (OSMesg)OS_EVENT_FLASH);
+    card_inits++;
+}
+
+static u32 trace_count;
+
+void trace_event(u32 event, u32 arg0, u32 arg1) {
+    trace_count++;
+}
+
+static void sim_command(u32 cmd) {
+    u32 page = sim.page_addr / BYTES_PER_PAGE;
+
+    sim.commands++;
+
+    if (sim.pull_on_next_cmd) {
+        sim.pull_on_next_cmd = FALSE;
+        sim.card_pulled = TRUE;
+        sim.busy = SIM_BUSY_POLLS;
+        sim_raise(OS_EVENT_MD);
+        return;
+    }
+
+    page %= sim.pages;
+
+    if ((cmd & ~NAND_CMD_INTR) == NAND_CMD_READ_PAGE) {
+        sim.page_reads++;
+        sim.ecc = sim.ecc_error[page];
+        sim.busy_ns += NAND_TR_NS + (BYTES_PER_PAGE + SPARE_SIZE) * NAND_TRC_NS;
+    } else if ((cmd & ~NAND_CMD_INTR) == NAND_CMD_READ_SPARE) {
+        sim.spare_reads++;
+        sim.ecc = FALSE;
+        sim.busy_ns += NAND_TR_NS + SPARE_SIZE * NAND_TRC_NS;
+    } else {
+        fprintf(stderr, "unexpected NAND command %08X\n", cmd);
+        exit(1);
+    }
+
+    sim.spare_regs[0] = be32(&sim.spare[page][0]);
+    sim.spare_regs[1] = be32(&sim.spare[page][4]);
+
+    if (cmd & NAND_CMD_INTR) {
+        // the interrupt path never polls, so the command is done by the time the event is delivered
+        sim.busy = 0;
+        sim_raise(OS_EVENT_FLASH);
+    } else {
+        sim.busy = SIM_BUSY_POLLS;
+    }
+}
+
+static u32 sim_read(u32 addr) {
+    switch (addr) {
+        case PI_48_REG:
+            sim.polls++;
+            if (sim.busy > 0) {
+                sim.busy--;
+                return PI_48_BUSY;
+            }
+            return sim.ecc ? PI_48_ECC : 0;
+
+        case MI_38_REG:
+            return sim.card_pulled ? MI_38_CARD_PULLED : 0;
+
+        case PI_10400_REG:
+            return sim.spare_regs[0];
+
+        case PI_10404_REG:
+            return sim.spare_regs[1];
+    }
+
+    fprintf(stderr, "unexpected register read %08X\n", addr);
+    exit(1);
+}
+
+static void sim_write(u32 addr, u32 data) {
+    switch (addr) {
+        case PI_70_REG:
+            sim.page_addr = data;
+            return;
+
+        case PI_48_REG:
+            if (data == 0) {
+                sim.aborts++;
+                sim.busy = 0;
+            } else {
+                sim_command(data);
+            }
+            return;
+    }
+
+    fprintf(stderr, "unexpected register write %08X <- %08X\n", addr, data);
+    exit(1);
+}
+
+static void sim_reset(u32 blocks) {
+    free(sim.spare);
+    free(sim.ecc_error);
+    bzero(&sim, sizeof(sim));
+
+    sim.pages = blocks * PAGES_PER_BLOCK;
+    sim.spare = malloc(sim.pages * SPARE_SIZE);
+    sim.ecc_error = calloc(sim.pages, 1);
+    for (u32 i = 0; i < sim.pages; i++) {
+        for (u32 j = 0; j < SPARE_SIZE; j++) {
+            sim.spare[i][j] = 0xFF;
+        }
+    }
+
+    reset_bad_block_table();
+    trace_count = 0;
+}
+
+// takes the spare dump either a block at a time (page 0's spare) or a page at a time
+static s32 sim_load_spare(const char *path) {
+    FILE *f = fopen(path, "rb");
+    u8 spare[SPARE_SIZE];
+    long size;
+    s32 per_page;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    // 64MiB cards have 4096 blocks, so a per block dump is 64KiB and a per page one 2MiB
+    per_page = size > (long)(NAND_MAX_BLOCKS * SPARE_SIZE);
+    sim_reset((per_page ? (size / PAGES_PER_BLOCK) : size) / SPARE_SIZE);
+
+    for (u32 i = 0; fread(spare, 1, SPARE_SIZE, f) == SPARE_SIZE; i++) {
+        u32 page = per_page ? i : (i * PAGES_PER_BLOCK);
+
+        for (u32 j = 0; j < SPARE_SIZE; j++) {
+            sim.spare[page][j] = spare[j];
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void set_link(u32 block, u8 next) {
+    u8 *spare = sim.spare[block * PAGES_PER_BLOCK];
+
+    spare[0] = spare[1] = spare[2] = next;
+}
+
+static void set_status(u32 block, u8 status) {
+    sim.spare[block * PAGES_PER_BLOCK][5] = status;
+}
+
+// follows the chain from start the way find_sa2_blocks does, for up to max_blocks or until it leaves the card or loops,
+// returning the number of blocks walked
+static u32 walk_chain(u16 start, u32 cmd, u16 *chain, u32 max_blocks) {
+    u32 num = 0;
+    u16 block = start;
+
+    while ((num < max_blocks) && (block < (sim.pages / PAGES_PER_BLOCK))) {
+        for (u32 i = 0; i < num; i++) {
+            if (chain[i] == block) {
+                return num;
+            }
+        }
+        chain[num++] = block;
+
+        if (nand_read(block * PAGES_PER_BLOCK, cmd) != 0) {
+            break;
+        }
+        block = block_link(IO_READ(PI_10400_REG));
+    }
+
+    return num;
+}
+
+static void print_walk(const char *name, u32 num) {
+    u64 cycles = (sim.busy_ns * CPU_MHZ) / 1000;
+
+    printf("  %-18s %4u reads, %9llu ns, %10llu cycles (%llu per block)\n", name, sim.commands,
+           (unsigned long long)sim.busy_ns, (unsigned long long)cycles, (unsigned long long)(cycles / num));
+}
+
+// compares the two ways of walking the chain; the spare-only one is only modeled here, it isn't yet known whether the
+// hardware really does leave the spare in PI_10400_REG/PI_10404_REG for it
+static s32 compare_walks(u16 start, u32 max_blocks) {
+    u16 *full = malloc(max_blocks * sizeof(u16));
+    u16 *spare = malloc(max_blocks * sizeof(u16));
+    u32 num_full, num_spare;
+    s32 same;
+
+    sim.commands = sim.busy_ns = 0;
+    num_full = walk_chain(start, NAND_CMD_READ_PAGE, full, max_blocks);
+    printf("chain from block %u: %u blocks\n", start, num_full);
+    if (num_full == 0) {
+        return -1;
+    }
+    print_walk("full page reads:", num_full);
+
+    sim.commands = sim.busy_ns = 0;
+    num_spare = walk_chain(start, NAND_CMD_READ_SPARE, spare, max_blocks);
+    print_walk("spare-only reads:", num_spare);
+
+    same = (num_full == num_spare);
+    for (u32 i = 0; same && (i < num_full); i++) {
+        same = (full[i] == spare[i]);
+    }
+    if (!same) {
+        printf("  the two walks took different paths\n");
+    }
+
+    free(full);
+    free(spare);
+    return same ? 0 : -1;
+}
+
+static s32 failures;
+
+#define CHECK(cond)                                                  \
+    do {                                                             \
+        if (!(cond)) {                                               \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                              \
+        }                                                            \
+    } while (0)
+
+static void test_reads(const char *name) {
+    u8 bad;
+    u16 good;
+
+    printf("%s\n", name);
+
+    set_link(5, 9);
+    CHECK(read_spare(5 * PAGES_PER_BLOCK) == 0);
+    CHECK(block_link(IO_READ(PI_10400_REG)) == 9);
+
+    // 2 of 3 copies of the link agreeing wins, otherwise the third copy is used
+    set_link(6, 0x22);
+    sim.spare[6 * PAGES_PER_BLOCK][2] = 0x11;
+    CHECK(read_spare(6 * PAGES_PER_BLOCK) == 0);
+    CHECK(block_link(IO_READ(PI_10400_REG)) == 0x22);
+
+    // one clear bit in the status byte is still good, two is bad
+    set_status(1, 0xFE);
+    set_status(2, 0xFC);
+    set_status(3, 0x00);
+    CHECK((lookup_block(1, &bad) == 0) && !bad);
+    CHECK((lookup_block(2, &bad) == 0) && bad);
+    CHECK(find_next_good_block(&good, 2) == 0);
+    CHECK(good == 4);
+
+    // looked-up blocks come from the table after that
+    u32 commands = sim.commands;
+    CHECK((lookup_block(2, &bad) == 0) && bad);
+    CHECK(sim.commands == commands);
+
+    // an ECC error is reported
+    sim.ecc_error[10 * PAGES_PER_BLOCK] = TRUE;
+    CHECK(read_page(10 * PAGES_PER_BLOCK) == 1);
+    CHECK(trace_count == 1);
+#ifndef NAND_SPARE_READS
+    // the status comes from a full page read too, so that sees it as well, and the block isn't trusted next time
+    CHECK(lookup_block(10, &bad) == 1);
+    commands = sim.commands;
+    lookup_block(10, &bad);
+    CHECK(sim.commands == commands + 1);
+    CHECK(trace_count == 3);
+#endif
+}
+
+static void test_card_pulled(const char *name) {
+    u8 bad;
+
+    printf("%s\n", name);
+
+    // pulled while the read is in flight: the command is abandoned rather than waited on
+    sim.pull_on_next_cmd = TRUE;
+    CHECK(read_page(0) == 2);
+    CHECK(sim.aborts == 1);
+
+    // and anything after that fails straight away, without being remembered
+    CHECK(lookup_block(20, &bad) == 2);
+    CHECK(!BBT_TEST(bbt_known, 20));
+    CHECK(sim.aborts == 2);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        if (sim_load_spare(argv[1]) != 0) {
+            return 1;
+        }
+        return compare_walks((argc > 2) ? strtoul(argv[2], NULL, 0) : 0,
+                             (argc > 3) ? strtoul(argv[3], NULL, 0) : (sim.pages / PAGES_PER_BLOCK)) != 0;
+    }
+
+    sim_reset(SIM_BLOCKS);
+    test_reads("poll: reads");
+    CHECK(sim.polls > sim.commands);
+    sim_reset(SIM_BLOCKS);
+    test_card_pulled("poll: card pulled");
+
+    sim_reset(SIM_BLOCKS);
+    osBbCardInit();
+    card_inits = 0;
+    claim_nand_interrupts();
+    CHECK((event_queue[OS_EVENT_FLASH] == &nand_mesg_queue) && (event_queue[OS_EVENT_MD] == &nand_mesg_queue));
+    test_reads("interrupt: reads");
+    // the interrupt path only looks at PI_48_REG for the ECC bit once the event arrives
+    CHECK(sim.polls == sim.commands);
+
+    // a stale card event from before the read is dropped rather than taken as the read's completion
+    sim_raise(OS_EVENT_MD);
+    CHECK(read_page(0) == 0);
+    CHECK(nand_mesg_queue.validCount == 0);
+
+    sim_reset(SIM_BLOCKS);
+    test_card_pulled("interrupt: card pulled");
+    release_nand_interrupts();
+    // the card driver gets its events back, and nothing is left pointing at nand_mesg_queue
+    CHECK(card_inits == 1);
+    CHECK((event_queue[OS_EVENT_FLASH] == &card_mesg_queue) && (event_queue[OS_EVENT_MD] != &nand_mesg_queue));
+
+#ifdef NAND_SPARE_READS
+    CHECK(sim.spare_reads != 0);
+#else
+    CHECK(sim.spare_reads == 0);
+#endif
+
+    // a made up chain, skipping around the card a bit like a real one would around bad blocks
+    sim_reset(SIM_BLOCKS);
+    for (u32 i = 0; i < 40; i++) {
+        set_link(8 + i, (i == 39) ? 0xFF : (8 + i + 1 + (i % 5 == 4)));
+    }
+    CHECK(compare_walks(8, 40) == 0);
+
+    if (failures) {
+        printf("%d checks failed\n", (int)failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,260 @@
+//
+//  Host known-answer test and benchmark for src/sha1.c
+//
+//  sha1bench           checks the FIPS 180 examples, then random lengths, alignments and splits of the input against a
+//                      straightforward byte-at-a-time SHA-1 (the way the SDK's one works)
+//  sha1bench -b [MiB]  compares the MB/s of the two, on aligned and unaligned input
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <PR/ultratypes.h>
+#include <macros.h>
+#include <sha1.h>
+
+#define DIGEST_SIZE (20)
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t length;
+    uint8_t block[64];
+    uint32_t used;
+} RefSha1;
+
+static uint32_t ref_rol(uint32_t x, u32 n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void ref_block(RefSha1 *ctx) {
+    uint32_t w[80];
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3], e = ctx->h[4];
+
+    for (u32 i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)ctx->block[i * 4] << 24) | ((uint32_t)ctx->block[i * 4 + 1] << 16) |
+               ((uint32_t)ctx->block[i * 4 + 2] << 8) | ctx->block[i * 4 + 3];
+    }
+    for (u32 i = 16; i < 80; i++) {
+        w[i] = ref_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    for (u32 i = 0; i < 80; i++) {
+        uint32_t f, k, t;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+
+        t = ref_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ref_rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->used = 0;
+}
+
+static void ref_reset(RefSha1 *ctx) {
+    static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    memset(ctx, 0, sizeof(*ctx));
+    memcpy(ctx->h, init, sizeof(init));
+}
+
+static void ref_input(RefSha1 *ctx, const u8 *data, u32 size) {
+    for (u32 i = 0; i < size; i++) {
+        ctx->block[ctx->used++] = data[i];
+        ctx->length++;
+        if (ctx->used == 64) {
+            ref_block(ctx);
+        }
+    }
+}
+
+static void ref_result(RefSha1 *ctx, u8 *digest) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        ref_block(ctx);
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (u32 i = 0; i < 8; i++) {
+        ctx->block[56 + i] = bits >> (56 - i * 8);
+    }
+    ref_block(ctx);
+
+    for (u32 i = 0; i < DIGEST_SIZE; i++) {
+        digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static void sha1(u8 *data, u32 size, u32 max_chunk, u8 *digest) {
+    SHA1Context ctx;
+    u32 pos = 0;
+
+    SHA1Reset(&ctx);
+    while (pos < size) {
+        u32 n = (max_chunk != 0) ? (rand() % (max_chunk + 1)) : size;
+
+        n = (n > size - pos) ? (size - pos) : n;
+        SHA1Input(&ctx, data + pos, n);
+        pos += n;
+    }
+    SHA1Result(&ctx, digest);
+}
+
+static void ref_sha1(u8 *data, u32 size, u8 *digest) {
+    RefSha1 ctx;
+
+    ref_reset(&ctx);
+    ref_input(&ctx, data, size);
+    ref_result(&ctx, digest);
+}
+
+static void hex(const u8 *digest, char *out) {
+    for (u32 i = 0; i < DIGEST_SIZE; i++) {
+        sprintf(out + i * 2, "%02x", digest[i]);
+    }
+}
+
+static s32 failures;
+
+static void kat(const char *name, u8 *data, u32 size, const char *expected) {
+    u8 digest[DIGEST_SIZE];
+    char got[DIGEST_SIZE * 2 + 1];
+
+    sha1(data, size, 0, digest);
+    hex(digest, got);
+    if (strcmp(got, expected) != 0) {
+        printf("  FAIL %s: got %s, expected %s\n", name, got, expected);
+        failures++;
+    }
+
+    ref_sha1(data, size, digest);
+    hex(digest, got);
+    if (strcmp(got, expected) != 0) {
+        printf("  FAIL %s (reference): got %s, expected %s\n", name, got, expected);
+        failures++;
+    }
+}
+
+static void run_kats(void) {
+    static u8 million_a[1000000];
+    static u8 abc[] = "abc";
+    static u8 two_blocks[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+    printf("known answers\n");
+
+    kat("empty", abc, 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    kat("abc", abc, 3, "a9993e364706816aba3e25717850c26c9cd0d89d");
+    kat("448 bits", two_blocks, 56, "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+    memset(million_a, 'a', sizeof(million_a));
+    kat("million a", million_a, sizeof(million_a), "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+}
+
+// every length around the block and padding boundaries, at every alignment, fed in random splits
+static void run_random(u32 count) {
+    u8 *buf = malloc(4096 + 8);
+    u8 digest[DIGEST_SIZE], ref[DIGEST_SIZE];
+
+    printf("random inputs against the reference\n");
+
+    for (u32 n = 0; n < count; n++) {
+        u32 size = (n < 200) ? n : (rand() % 4096);
+        u32 offset = n % 8;
+        u32 max_chunk = (n % 3 == 0) ? 0 : (1 + rand() % 150);
+
+        for (u32 i = 0; i < size; i++) {
+            buf[offset + i] = rand();
+        }
+
+        sha1(buf + offset, size, max_chunk, digest);
+        ref_sha1(buf + offset, size, ref);
+        if (memcmp(digest, ref, DIGEST_SIZE) != 0) {
+            printf("  FAIL %u bytes at offset %u, chunks of up to %u\n", size, offset, max_chunk);
+            failures++;
+        }
+    }
+
+    free(buf);
+}
+
+// best of a few runs, so the first one warming things up doesn't count against it
+static double mb_per_s(u8 *data, u32 size, s32 reference) {
+    struct timespec start, end;
+    u8 digest[DIGEST_SIZE];
+    double secs, best = 0;
+
+    for (u32 i = 0; i < 3; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (reference) {
+            ref_sha1(data, size, digest);
+        } else {
+            sha1(data, size, 0, digest);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best = MAX(best, size / secs / 1e6);
+    }
+
+    return best;
+}
+
+static void bench(u32 mib) {
+    u32 size = mib << 20;
+    u8 *buf = malloc(size + 4);
+
+    for (u32 i = 0; i < size + 4; i++) {
+        buf[i] = rand();
+    }
+
+    printf("%u MiB aligned:   SHA1Input %.1f MB/s, reference %.1f MB/s\n", mib, mb_per_s(buf, size, FALSE),
+           mb_per_s(buf, size, TRUE));
+    printf("%u MiB unaligned: SHA1Input %.1f MB/s, reference %.1f MB/s\n", mib, mb_per_s(buf + 1, size, FALSE),
+           mb_per_s(buf + 1, size, TRUE));
+
+    free(buf);
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        bench((argc > 2) ? strtoul(argv[2], NULL, 0) : 64);
+        return 0;
+    }
+
+    run_kats();
+    run_random(5000);
+
+    if (failures) {
+        printf("%d checks failed\n", (int)failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
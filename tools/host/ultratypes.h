@@ -0,0 +1,43 @@
+//
+//  Stands in for include/PR/ultratypes.h in host builds (it's force-included, so the real one is skipped), giving the
+//  fixed-width types their target sizes: a 64-bit host's long would make u32 64 bits wide
+//
+
+#ifndef _ULTRATYPES_H_
+#define _ULTRATYPES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef volatile uint8_t vu8;
+typedef volatile uint16_t vu16;
+typedef volatile uint32_t vu32;
+typedef volatile uint64_t vu64;
+
+typedef volatile int8_t vs8;
+typedef volatile int16_t vs16;
+typedef volatile int32_t vs32;
+typedef volatile int64_t vs64;
+
+typedef float f32;
+typedef double f64;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#endif
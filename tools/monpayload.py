@@ -0,0 +1,188 @@
+#
+#   Host side of mon's block payload format, used once a transfer mode has been set with CMD_SET_XFER_MODE (0x45)
+#
+#   Each block payload starts with a big-endian header word, type in the top byte:
+#     PAYLOAD_RAW     - the 16KiB block follows
+#     PAYLOAD_UNIFORM - nothing follows, every byte of the block is the low byte of the header
+#     PAYLOAD_LZ4     - a raw LZ4 block of the size in the low 24 bits follows, padded to a word
+#
+#   expand turns a captured CMD_READ_BLOCKS reply stream into a flat image, pack does the reverse for CMD_WRITE_BLOCKS,
+#   and stats decodes the reply to CMD_GET_XFER_STATS (0x46)
+#
+
+import argparse, struct, sys
+
+from sa2pack import lz4_block, lz4_compress_block, lz4_decompress_block
+
+BYTES_PER_BLOCK = 16 * 1024
+SPARE_SIZE = 16
+
+XFER_UNIFORM = 1 << 0
+XFER_LZ4 = 1 << 1
+
+PAYLOAD_RAW = 0
+PAYLOAD_UNIFORM = 1
+PAYLOAD_LZ4 = 2
+
+# matches XferStats in src/mon.c
+STATS_FIELDS = ('blocks', 'raw_blocks', 'uniform_blocks', 'lz4_blocks', 'raw_bytes', 'wire_bytes', 'prepare_cycles')
+# osGetCount ticks per second
+COUNT_RATE = 62500000 * 3 // 4
+
+
+def uniform_fill(block):
+    if block.count(block[:1]) == len(block):
+        return block[0]
+    return None
+
+
+def encode_payload(block, mode):
+    if mode == 0:
+        return block
+
+    if mode & XFER_UNIFORM:
+        fill = uniform_fill(block)
+        if fill is not None:
+            return struct.pack('>I', (PAYLOAD_UNIFORM << 24) | fill)
+
+    if mode & XFER_LZ4:
+        packed = lz4_compress_block(block)
+        # only worth it if it comes out smaller than the raw block
+        if len(packed) < len(block):
+            return struct.pack('>I', (PAYLOAD_LZ4 << 24) | len(packed)) + packed + bytes(-len(packed) % 4)
+
+    return struct.pack('>I', (PAYLOAD_RAW << 24) | BYTES_PER_BLOCK) + block
+
+
+def read_exact(f, size):
+    data = f.read(size)
+    if len(data) != size:
+        raise EOFError
+    return data
+
+
+def decode_payload(f, mode):
+    if mode == 0:
+        return read_exact(f, BYTES_PER_BLOCK)
+
+    header = struct.unpack('>I', read_exact(f, 4))[0]
+    kind, arg = header >> 24, header & 0xFFFFFF
+
+    if kind == PAYLOAD_RAW:
+        return read_exact(f, arg)
+    if kind == PAYLOAD_UNIFORM:
+        return bytes([arg & 0xFF]) * BYTES_PER_BLOCK
+    if kind == PAYLOAD_LZ4:
+        packed = read_exact(f, arg + (-arg % 4))[:arg]
+        if lz4_block is not None:
+            return lz4_block.decompress(packed, uncompressed_size=BYTES_PER_BLOCK)
+        out = bytearray()
+        lz4_decompress_block(packed, out)
+        return bytes(out)
+
+    raise ValueError(f'unknown payload type {kind}')
+
+
+def expand(args):
+    blocks = {}
+    spares = {}
+    counts = {}
+
+    with open(args.input, 'rb') as f:
+        while True:
+            try:
+                block, status = struct.unpack('>Ii', read_exact(f, 8))
+            except EOFError:
+                break
+
+            start = f.tell()
+            blocks[block] = decode_payload(f, args.mode)
+            counts[block] = f.tell() - start
+            if args.spare:
+                spares[block] = read_exact(f, SPARE_SIZE)
+            if status != 0:
+                print(f'block {block:04X}: status {status}')
+
+    if not blocks:
+        print('Error: no blocks in input')
+        sys.exit(1)
+
+    first = min(blocks)
+    with open(args.output, 'wb') as f:
+        for block in range(first, max(blocks) + 1):
+            f.write(blocks.get(block, bytes([0xFF]) * BYTES_PER_BLOCK))
+
+    if args.spare:
+        with open(args.output + '.spare', 'wb') as f:
+            for block in range(first, max(blocks) + 1):
+                f.write(spares.get(block, bytes([0xFF]) * SPARE_SIZE))
+
+    wire = sum(counts.values())
+    raw = len(blocks) * BYTES_PER_BLOCK
+    print(f'{len(blocks)} blocks from {first:04X}, {wire} payload bytes for {raw} ({wire / raw:.3f})')
+
+
+def pack(args):
+    with open(args.input, 'rb') as f:
+        image = f.read()
+    image += bytes([0xFF]) * (-len(image) % BYTES_PER_BLOCK)
+
+    spare = None
+    if args.spare:
+        with open(args.spare, 'rb') as f:
+            spare = f.read()
+
+    with open(args.output, 'wb') as f:
+        for i in range(0, len(image), BYTES_PER_BLOCK):
+            f.write(encode_payload(image[i:i + BYTES_PER_BLOCK], args.mode))
+            if spare is not None:
+                index = i // BYTES_PER_BLOCK * SPARE_SIZE
+                f.write(spare[index:index + SPARE_SIZE].ljust(SPARE_SIZE, b'\xFF'))
+
+
+def stats(args):
+    with open(args.input, 'rb') as f:
+        data = f.read()
+
+    values = dict(zip(STATS_FIELDS, struct.unpack_from('>7I', data)))
+    for name in STATS_FIELDS:
+        print(f'{name:<16}{values[name]:>12}')
+
+    if values['raw_bytes']:
+        print(f'{"ratio":<16}{values["wire_bytes"] / values["raw_bytes"]:>12.3f}')
+        print(f'{"prepare ms":<16}{values["prepare_cycles"] * 1000 / COUNT_RATE:>12.3f}')
+    if args.rate:
+        # wire time the transfer mode saved at the given link rate
+        saved = (values['raw_bytes'] - values['wire_bytes']) / (args.rate * 1000)
+        print(f'{"wire ms saved":<16}{saved * 1000:>12.3f}')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Encode and decode mon block payloads')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('expand', help='captured CMD_READ_BLOCKS reply to flat image')
+    p.add_argument('input')
+    p.add_argument('output')
+    p.add_argument('-s', '--spare', action='store_true', help='records include spare data (written to OUTPUT.spare)')
+    p.add_argument('-m', '--mode', type=lambda x: int(x, 0), default=XFER_UNIFORM, help='negotiated transfer mode')
+    p.set_defaults(func=expand)
+
+    p = sub.add_parser('pack', help='flat image to CMD_WRITE_BLOCKS payload stream')
+    p.add_argument('input')
+    p.add_argument('output')
+    p.add_argument('-s', '--spare', help='spare data to interleave, 16 bytes per block')
+    p.add_argument('-m', '--mode', type=lambda x: int(x, 0), default=XFER_UNIFORM, help='negotiated transfer mode')
+    p.set_defaults(func=pack)
+
+    p = sub.add_parser('stats', help='decode a CMD_GET_XFER_STATS reply')
+    p.add_argument('input')
+    p.add_argument('-r', '--rate', type=float, help='link rate in KB/s, to estimate the wire time saved')
+    p.set_defaults(func=stats)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,221 @@
+#
+#   Repack SA2 content in one of the formats SA1 can decompress, and report how the formats compare
+#
+#   Input is either the raw SA2 image or an existing gzip payload
+#   LZ4 output uses the legacy frame format, compressed with python-lz4 if it's installed, or a simple built-in compressor otherwise
+#
+
+import argparse, gzip, struct, sys, time, zlib
+
+BYTES_PER_BLOCK = 16 * 1024
+
+LZ4_LEGACY_MAGIC = 0x184C2102
+LZ4_LEGACY_BLOCK_SIZE = 8 * 1024 * 1024
+
+MIN_MATCH = 4
+# the last match has to start at least this far from the end of a block, and the last 5 bytes are always literals
+MF_LIMIT = 12
+LAST_LITERALS = 5
+MAX_OFFSET = 0xFFFF
+
+try:
+    import lz4.block as lz4_block
+except ImportError:
+    lz4_block = None
+
+
+def lz4_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4_sequence(out, literals, offset, match_len):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if match_len:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit_len >= 15:
+        lz4_length(out, lit_len - 15)
+    out += literals
+    if match_len:
+        out += struct.pack('<H', offset)
+        if match_len - MIN_MATCH >= 15:
+            lz4_length(out, match_len - MIN_MATCH - 15)
+
+
+def lz4_compress_block(data):
+    if lz4_block is not None:
+        return lz4_block.compress(data, mode='high_compression', compression=12, store_size=False)
+
+    # greedy single-probe hash matcher, nowhere near lz4hc but valid
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = len(data) - MF_LIMIT
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        ref = table.get(key)
+        table[key] = pos
+        if ref is None or pos - ref > MAX_OFFSET:
+            pos += 1
+            continue
+
+        match_len = MIN_MATCH
+        max_len = len(data) - LAST_LITERALS - pos
+        while match_len < max_len and data[ref + match_len] == data[pos + match_len]:
+            match_len += 1
+
+        lz4_sequence(out, data[anchor:pos], pos - ref, match_len)
+        pos += match_len
+        anchor = pos
+
+    lz4_sequence(out, data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def lz4_decompress_block(data, out):
+    pos = 0
+    while pos < len(data):
+        token = data[pos]
+        pos += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                lit_len += byte
+                if byte != 255:
+                    break
+        out += data[pos:pos + lit_len]
+        pos += lit_len
+        if pos == len(data):
+            break
+        offset = data[pos] | (data[pos + 1] << 8)
+        pos += 2
+        match_len = token & 15
+        if match_len == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                match_len += byte
+                if byte != 255:
+                    break
+        match_len += MIN_MATCH
+        start = len(out) - offset
+        if offset <= 0 or start < 0:
+            raise ValueError('bad LZ4 match offset')
+        for i in range(match_len):
+            out.append(out[start + i])
+
+
+def lz4_pack(data):
+    out = bytearray(struct.pack('<I', LZ4_LEGACY_MAGIC))
+    for start in range(0, len(data), LZ4_LEGACY_BLOCK_SIZE):
+        block = lz4_compress_block(data[start:start + LZ4_LEGACY_BLOCK_SIZE])
+        out += struct.pack('<I', len(block))
+        out += block
+    return bytes(out)
+
+
+def lz4_unpack(payload):
+    if struct.unpack_from('<I', payload)[0] != LZ4_LEGACY_MAGIC:
+        raise ValueError('not an LZ4 legacy frame')
+    out = bytearray()
+    pos = 4
+    while pos + 4 <= len(payload):
+        size = struct.unpack_from('<I', payload, pos)[0]
+        pos += 4
+        if size == 0:
+            break
+        if size == LZ4_LEGACY_MAGIC:
+            continue
+        if lz4_block is not None:
+            out += lz4_block.decompress(payload[pos:pos + size], uncompressed_size=LZ4_LEGACY_BLOCK_SIZE)
+        else:
+            lz4_decompress_block(payload[pos:pos + size], out)
+        pos += size
+    return bytes(out)
+
+
+def gzip_pack(data):
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def gzip_unpack(payload):
+    # tolerate the block padding after the gzip member
+    return zlib.decompressobj(31).decompress(payload)
+
+
+FORMATS = {
+    'gzip': (gzip_pack, gzip_unpack),
+    'lz4': (lz4_pack, lz4_unpack),
+}
+
+
+def pad(payload):
+    return payload + bytes(-len(payload) % BYTES_PER_BLOCK)
+
+
+def timed(func, arg, repeat):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        result = func(arg)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return result, best
+
+
+def report(data, repeat):
+    print(f'{"format":<8}{"size":>10}{"blocks":>8}{"ratio":>8}{"host decode":>14}')
+    print(f'{"raw":<8}{len(data):>10}{len(pad(data)) // BYTES_PER_BLOCK:>8}{1.0:>8.3f}{"-":>14}')
+    for name, (pack, unpack) in FORMATS.items():
+        payload = pack(data)
+        result, elapsed = timed(unpack, pad(payload), repeat)
+        if result != data:
+            raise ValueError(f'{name} round trip failed')
+        # pure python LZ4 decoding says nothing about the real decode speed
+        if name == 'lz4' and lz4_block is None:
+            decode = 'n/a'
+        else:
+            decode = f'{elapsed * 1000:.2f} ms'
+        ratio = len(payload) / len(data) if data else 0
+        print(f'{name:<8}{len(payload):>10}{len(pad(payload)) // BYTES_PER_BLOCK:>8}{ratio:>8.3f}{decode:>14}')
+
+    if lz4_block is None:
+        print('(install python-lz4 for LZ4 timings and better compression)')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Repack SA2 content for SA1')
+    parser.add_argument('input', help='raw SA2 image or gzip payload')
+    parser.add_argument('output', nargs='?', help='repacked payload, padded to a whole number of blocks')
+    parser.add_argument('-f', '--format', choices=FORMATS.keys(), default='lz4')
+    parser.add_argument('-r', '--repeat', type=int, default=5, help='decode timing runs')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+
+    if data[:2] == b'\x1F\x8B':
+        data = gzip_unpack(data)
+
+    report(data, args.repeat)
+
+    if args.output:
+        pack, unpack = FORMATS[args.format]
+        payload = pack(data)
+        if unpack(pad(payload)) != data:
+            print(f'Error: {args.format} round trip failed')
+            sys.exit(1)
+
+        with open(args.output, 'wb') as f:
+            f.write(pad(payload))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,117 @@
+#
+#   Turn a boot trace buffer (as sent by mon's CMD_GET_TRACE, 0x40) into per-phase timing tables
+#
+#   The buffer is big-endian: a 16 byte header (magic, count rate, entries written, pad) followed by a ring of
+#   16 byte entries (osGetCount timestamp, event, arg0, arg1)
+#
+
+import argparse, struct, sys
+
+TRACE_MAGIC = 0x54524345
+TRACE_SIZE = 0x1000
+HEADER_SIZE = 16
+ENTRY_SIZE = 16
+TRACE_ENTRIES = (TRACE_SIZE - HEADER_SIZE) // ENTRY_SIZE
+
+# matches TraceEvent in src/trace.h
+EVENTS = {
+    1: 'boot',
+    2: 'setup_vi',
+    3: 'os init',
+    4: 'controllers',
+    5: 'menu',
+    6: 'sa2 start',
+    7: 'sa2 chain',
+    8: 'sa2 inflate',
+    9: 'sa2 verify',
+    10: 'sa2 done',
+    11: 'nand error',
+    12: 'launch',
+}
+
+TRACE_BOOT = 1
+TRACE_SA2_DECOMPRESS = 8
+TRACE_SA2_VERIFY = 9
+TRACE_NAND_ERROR = 11
+
+
+def parse(data):
+    magic, count_rate, written, _ = struct.unpack_from('>4I', data)
+    if magic != TRACE_MAGIC:
+        raise ValueError(f'bad trace magic {magic:08X}')
+
+    oldest = max(0, written - TRACE_ENTRIES)
+    entries = []
+    for i in range(oldest, written):
+        offset = HEADER_SIZE + (i % TRACE_ENTRIES) * ENTRY_SIZE
+        entries.append(struct.unpack_from('>4I', data, offset))
+
+    return count_rate, entries, oldest > 0
+
+
+def split_boots(entries):
+    boots = []
+    for entry in entries:
+        if entry[1] == TRACE_BOOT or not boots:
+            boots.append([])
+        boots[-1].append(entry)
+    return boots
+
+
+def ms(ticks, count_rate):
+    return ticks * 1000 / count_rate
+
+
+def print_boot(index, boot, count_rate):
+    start = boot[0][0]
+    prev = start
+    nand_errors = 0
+
+    print(f'boot {index}' + (f' (entry type {boot[0][2]:X})' if boot[0][1] == TRACE_BOOT else ' (start lost)'))
+    print(f'  {"event":<12}{"at ms":>10}{"phase ms":>10}  {"arg0":>8} {"arg1":>8}')
+    for time, event, arg0, arg1 in boot:
+        # the counter is 32 bits, so work modulo 2^32
+        at = ms((time - start) & 0xFFFFFFFF, count_rate)
+        phase = ms((time - prev) & 0xFFFFFFFF, count_rate)
+        prev = time
+        name = EVENTS.get(event, f'? {event}')
+        print(f'  {name:<12}{at:>10.3f}{phase:>10.3f}  {arg0:>8X} {arg1:>8X}')
+
+        if event == TRACE_SA2_DECOMPRESS and phase > 0:
+            print(f'  {"":<12}{"":>10}{"":>10}  {arg0} bytes out, {arg1} bytes read, {arg1 / phase / 1000:.2f} MB/s in')
+        elif event == TRACE_SA2_VERIFY:
+            print(f'  {"":<12}{"":>10}{"":>10}  {ms(arg0, count_rate):.3f} ms hashing, ' + ('ok' if arg1 == 0 else 'MISMATCH'))
+        elif event == TRACE_NAND_ERROR:
+            nand_errors += 1
+
+    if nand_errors:
+        print(f'  {nand_errors} NAND errors')
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an SA1 boot trace')
+    parser.add_argument('input', help='trace buffer dump')
+    parser.add_argument('-a', '--all', action='store_true', help='show every boot in the buffer, not just the last')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+
+    if len(data) < TRACE_SIZE:
+        print(f'Error: expected {TRACE_SIZE} bytes, got {len(data)}')
+        sys.exit(1)
+
+    count_rate, entries, wrapped = parse(data)
+    if wrapped:
+        print('(trace has wrapped, the oldest entries are gone)')
+
+    boots = split_boots(entries)
+    if not args.all:
+        boots = boots[-1:]
+    for i, boot in enumerate(boots):
+        print_boot(i, boot, count_rate)
+
+
+if __name__ == '__main__':
+    main()